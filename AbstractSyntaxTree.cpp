@@ -4,6 +4,8 @@
 #include "Optimizer.h"
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/BinaryFormat/Dwarf.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
@@ -11,11 +13,16 @@
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
@@ -51,9 +58,12 @@ public:
     lexicalBlocks.clear();
   }
 
+  // The builder goes with it: the module holds the finished metadata, and
+  // the builder must not outlive the context, which --run hands to the JIT.
   void finalize() {
     if (diBuilder) {
       diBuilder->finalize();
+      diBuilder.reset();
     }
   }
 
@@ -106,6 +116,33 @@ public:
 DebugInfo debugInfo;
 std::size_t asyncWrapperCounter = 0;
 std::size_t parForWrapperCounter = 0;
+// Task group of the function (or parfor wrapper) being generated, once one of
+// its async, await, or sync expressions asked for it.
+AllocaInst *currentTaskGroup = nullptr;
+// `for` loops around the expression being generated, counted within the
+// current function or parfor wrapper. Async calls inside one are batched.
+unsigned forLoopDepth = 0;
+// Set by a batched async, so the outermost loop around it publishes the
+// batch when it exits.
+bool asyncBatched = false;
+
+// Counts a `for` loop while its code is generated, and puts the count back
+// on every way out, errors included. The outermost loop either publishes
+// its batch or failed, so leaving it also clears asyncBatched.
+class ForLoopScope {
+  unsigned savedDepth = forLoopDepth;
+
+public:
+  ForLoopScope() { ++forLoopDepth; }
+  ~ForLoopScope() {
+    forLoopDepth = savedDepth;
+    if (savedDepth == 0) {
+      asyncBatched = false;
+    }
+  }
+
+  bool outermost() const { return savedDepth == 0; }
+};
 
 struct CapturedBinding {
   std::string name;
@@ -179,12 +216,115 @@ static Function *getOrCreateFreeFunction() {
   return getOrCreateRuntimeFunction("free", freeType);
 }
 
+static Constant *getOrCreateGlobalString(const std::string &text) {
+  std::string name = ".str." + text;
+  if (GlobalVariable *existing = theModule->getNamedGlobal(name)) {
+    return existing;
+  }
+  Constant *init = ConstantDataArray::getString(*theContext, text);
+  auto *global = new GlobalVariable(*theModule, init->getType(), true,
+                                    GlobalValue::PrivateLinkage, init, name);
+  global->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return global;
+}
+
+// Describes a parallel construct to the runtime, which tags its trace events
+// with it: the symbol that runs the work (a wrapper, or the function waiting
+// in a sync), the source file, and the line. A parfor also passes the
+// estimated cost of one iteration, or 0, and an async call its priority: 0
+// for normal, 1 for `high`, 2 for `low`. Laid out like CallSite in
+// runtime.cpp.
+static Constant *createCallSite(const std::string &symbol, int line,
+                                uint64_t iterationCost = 0,
+                                uint64_t priority = 0) {
+  PointerType *ptrTy = PointerType::get(*theContext, 0);
+  Type *lineTy = Type::getInt64Ty(*theContext);
+  StructType *siteTy =
+      StructType::get(*theContext, {ptrTy, ptrTy, lineTy, lineTy, lineTy});
+  std::string file = debugInfo.unit ? debugInfo.unit->getFilename().str() : "";
+  Constant *fields[] = {
+      getOrCreateGlobalString(symbol), getOrCreateGlobalString(file),
+      ConstantInt::get(lineTy, static_cast<uint64_t>(std::max(line, 0))),
+      ConstantInt::get(lineTy, iterationCost),
+      ConstantInt::get(lineTy, priority)};
+  auto *site =
+      new GlobalVariable(*theModule, siteTy, true, GlobalValue::PrivateLinkage,
+                         ConstantStruct::get(siteTy, fields), "callsite");
+  site->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return site;
+}
+
+// Returns the task group of the function being generated. The first request
+// reserves the group's storage in the entry block and enters it there, so
+// functions without async, await, or sync never touch the runtime.
+static Value *getOrCreateTaskGroup() {
+  if (currentTaskGroup) {
+    return currentTaskGroup;
+  }
+
+  FunctionType *enterType =
+      FunctionType::get(Type::getVoidTy(*theContext),
+                        {PointerType::get(*theContext, 0)}, false);
+  Function *enterFunc =
+      getOrCreateRuntimeFunction("__compiler_group_enter", enterType);
+  if (!enterFunc) {
+    return logErrorV(
+        "Runtime function signature mismatch: __compiler_group_enter");
+  }
+
+  // The runtime's group fits in four 8-byte words of the caller's frame.
+  Function *func = builder->GetInsertBlock()->getParent();
+  IRBuilder<> entryBuilder(&func->getEntryBlock(),
+                           func->getEntryBlock().begin());
+  entryBuilder.SetCurrentDebugLocation(builder->getCurrentDebugLocation());
+  Type *storageTy = ArrayType::get(Type::getInt64Ty(*theContext), 4);
+  currentTaskGroup = entryBuilder.CreateAlloca(storageTy, nullptr, "taskgroup");
+  entryBuilder.CreateCall(enterFunc, {currentTaskGroup});
+  return currentTaskGroup;
+}
+
+// Leaves the current task group, if any, right before the function returns.
+// The runtime waits there for every task the activation issued, since their
+// group lives in this frame. `line` is where the function is defined.
+static bool emitTaskGroupLeave(int line) {
+  if (!currentTaskGroup) {
+    return true;
+  }
+
+  PointerType *ptrTy = PointerType::get(*theContext, 0);
+  FunctionType *leaveType = FunctionType::get(Type::getVoidTy(*theContext),
+                                              {ptrTy, ptrTy}, false);
+  Function *leaveFunc =
+      getOrCreateRuntimeFunction("__compiler_group_leave", leaveType);
+  if (!leaveFunc) {
+    logErrorV("Runtime function signature mismatch: __compiler_group_leave");
+    return false;
+  }
+  Function *func = builder->GetInsertBlock()->getParent();
+  builder->CreateCall(leaveFunc, {currentTaskGroup,
+                                  createCallSite(func->getName().str(), line)});
+  return true;
+}
+
+// Publishes the async calls the current thread batched in a loop.
+static bool emitAsyncFlush() {
+  FunctionType *flushType =
+      FunctionType::get(Type::getVoidTy(*theContext), {}, false);
+  Function *flushFunc =
+      getOrCreateRuntimeFunction("__compiler_async_flush", flushType);
+  if (!flushFunc) {
+    logErrorV("Runtime function signature mismatch: __compiler_async_flush");
+    return false;
+  }
+  builder->CreateCall(flushFunc, {});
+  return true;
+}
+
 static Function *createAsyncWrapper(Function *calleeF, std::size_t argCount) {
   PointerType *ptrTy = PointerType::get(*theContext, 0);
   Type *doubleTy = Type::getDoubleTy(*theContext);
-  // Each wrapper has the generic runtime shape: void wrapper(void *data).
-  FunctionType *wrapperType =
-      FunctionType::get(Type::getVoidTy(*theContext), {ptrTy}, false);
+  // Each wrapper has the generic runtime shape: double wrapper(void *data).
+  FunctionType *wrapperType = FunctionType::get(doubleTy, {ptrTy}, false);
   std::string wrapperName =
       "__compiler_async_wrapper_" + std::to_string(asyncWrapperCounter++);
   Function *wrapperFunc = Function::Create(
@@ -195,7 +335,7 @@ static Function *createAsyncWrapper(Function *calleeF, std::size_t argCount) {
 
   Argument *rawData = wrapperFunc->getArg(0);
   rawData->setName("rawdata");
-  // The payload is stored as a heap array of doubles.
+  // The payload is the argument area of a runtime task record.
   Value *doubleData = wrapperBuilder.CreateBitCast(rawData, ptrTy, "args");
 
   std::vector<Value *> callArgs;
@@ -210,26 +350,152 @@ static Function *createAsyncWrapper(Function *calleeF, std::size_t argCount) {
         wrapperBuilder.CreateLoad(doubleTy, argPtr, "arg" + std::to_string(i)));
   }
 
-  // Call the original function, then free the heap payload.
-  wrapperBuilder.CreateCall(calleeF, callArgs);
-  Function *freeFunc = getOrCreateFreeFunction();
-  wrapperBuilder.CreateCall(freeFunc, rawData);
-  wrapperBuilder.CreateRetVoid();
+  // Call the original function and hand its result back to the runtime,
+  // which keeps it in the record for await.
+  Value *result = wrapperBuilder.CreateCall(calleeF, callArgs, "result");
+  wrapperBuilder.CreateRet(result);
   verifyFunction(*wrapperFunc);
   return wrapperFunc;
 }
 
+// Instructions assumed for a call to a function defined outside the module,
+// such as printd or sin.
+constexpr uint64_t kExternCallCost = 50;
+// Nested calls followed when estimating a cost.
+constexpr unsigned kMaxCostDepth = 4;
+
+// Estimates the instructions one run of `func` executes, counting both arms
+// of every branch and following calls into functions of this module. Costs
+// that depend on data are unknown and give 0: loops other than
+// `loopHeader` (a parfor wrapper's own loop), calls into the runtime (async,
+// await, sync, or a nested parfor), and recursion.
+static uint64_t estimateCost(Function *func, const BasicBlock *loopHeader,
+                             unsigned depth) {
+  if (depth > kMaxCostDepth) {
+    return 0;
+  }
+  for (BasicBlock &block : *func) {
+    // A function still being generated, such as a recursive caller.
+    if (!block.getTerminator()) {
+      return 0;
+    }
+  }
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 4> backEdges;
+  FindFunctionBackedges(*func, backEdges);
+  for (const auto &edge : backEdges) {
+    if (edge.second != loopHeader) {
+      return 0;
+    }
+  }
+
+  uint64_t cost = 0;
+  for (BasicBlock &block : *func) {
+    for (Instruction &inst : block) {
+      if (isa<DbgInfoIntrinsic>(inst)) {
+        continue;
+      }
+      auto *call = dyn_cast<CallInst>(&inst);
+      Function *callee = call ? call->getCalledFunction() : nullptr;
+      if (!call || (callee && callee->isIntrinsic())) {
+        ++cost;
+        continue;
+      }
+      if (!callee || callee->getName().starts_with("__compiler_")) {
+        return 0;
+      }
+      uint64_t calleeCost = callee->isDeclaration()
+                                ? kExternCallCost
+                                : estimateCost(callee, nullptr, depth + 1);
+      if (calleeCost == 0) {
+        return 0;
+      }
+      cost += calleeCost + 1;
+    }
+  }
+  return cost;
+}
+
+// Applies a parfor reduction operator to two values.
+static Value *emitReduceCombine(IRBuilder<> &reduceBuilder,
+                                const std::string &reduceOp, Value *lhs,
+                                Value *rhs) {
+  if (reduceOp == "+") {
+    return reduceBuilder.CreateFAdd(lhs, rhs, "reduce.add");
+  }
+  if (reduceOp == "*") {
+    return reduceBuilder.CreateFMul(lhs, rhs, "reduce.mul");
+  }
+  // min and max follow fmin/fmax: a NaN operand is ignored.
+  if (reduceOp == "min") {
+    return reduceBuilder.CreateMinNum(lhs, rhs, "reduce.min");
+  }
+  if (reduceOp == "max") {
+    return reduceBuilder.CreateMaxNum(lhs, rhs, "reduce.max");
+  }
+
+  Function *func = getFunction(std::string("binary") + reduceOp);
+  if (!func) {
+    return logErrorV("Unknown binary operator in parfor reduce");
+  }
+  return reduceBuilder.CreateCall(func, {lhs, rhs}, "reduce.op");
+}
+
+// Value of a reduction over no iterations. User-defined operators have no
+// known identity, so their empty loops yield 0.0 like a plain parfor.
+static double reduceIdentity(const std::string &reduceOp) {
+  if (reduceOp == "*") {
+    return 1.0;
+  }
+  if (reduceOp == "min") {
+    return std::numeric_limits<double>::infinity();
+  }
+  if (reduceOp == "max") {
+    return -std::numeric_limits<double>::infinity();
+  }
+  return 0.0;
+}
+
+// Builds the double(double, double) function the runtime uses to combine the
+// partial results of a reduction's ranges.
+static Function *createReduceCombine(const std::string &reduceOp,
+                                     const std::string &wrapperName) {
+  Type *doubleTy = Type::getDoubleTy(*theContext);
+  FunctionType *combineType =
+      FunctionType::get(doubleTy, {doubleTy, doubleTy}, false);
+  Function *combineFunc =
+      Function::Create(combineType, Function::PrivateLinkage,
+                       wrapperName + "_combine", theModule.get());
+
+  BasicBlock *entryBB = BasicBlock::Create(*theContext, "entry", combineFunc);
+  IRBuilder<> combineBuilder(entryBB);
+  Value *combined =
+      emitReduceCombine(combineBuilder, reduceOp, combineFunc->getArg(0),
+                        combineFunc->getArg(1));
+  if (!combined) {
+    combineFunc->eraseFromParent();
+    return nullptr;
+  }
+  combineBuilder.CreateRet(combined);
+  verifyFunction(*combineFunc);
+  return combineFunc;
+}
+
 static Function *
 createParForWrapper(const std::string &varName, ExprAST *body,
+                    const std::string &reduceOp,
                     const std::vector<CapturedBinding> &captures,
                     StructType *payloadTy, SourceLocation loc) {
   PointerType *ptrTy = PointerType::get(*theContext, 0);
   Type *doubleTy = Type::getDoubleTy(*theContext);
   Type *indexTy = Type::getInt64Ty(*theContext);
+  bool reduces = !reduceOp.empty();
   // Each parfor wrapper has the runtime shape:
   // void wrapper(void *data, std::size_t begin, std::size_t end).
+  // A reduction's wrapper returns the body values of its range folded with
+  // the operator instead.
   FunctionType *wrapperType = FunctionType::get(
-      Type::getVoidTy(*theContext), {ptrTy, indexTy, indexTy}, false);
+      reduces ? doubleTy : Type::getVoidTy(*theContext),
+      {ptrTy, indexTy, indexTy}, false);
   std::string wrapperName =
       "__compiler_parfor_wrapper_" + std::to_string(parForWrapperCounter++);
   Function *wrapperFunc = Function::Create(
@@ -243,6 +509,9 @@ createParForWrapper(const std::string &varName, ExprAST *body,
 
   auto savedIP = builder->saveIP();
   auto savedBindings = namedValues;
+  // Each chunk call gets its own task group for async work in the body.
+  AllocaInst *savedTaskGroup = currentTaskGroup;
+  currentTaskGroup = nullptr;
   debugInfo.lexicalBlocks.push_back(subprogram);
 
   BasicBlock *entryBB = BasicBlock::Create(*theContext, "entry", wrapperFunc);
@@ -295,6 +564,11 @@ createParForWrapper(const std::string &varName, ExprAST *body,
   builder->SetInsertPoint(loopBB);
   PHINode *indexPhi = builder->CreatePHI(indexTy, 2, "parfor.index");
   indexPhi->addIncoming(beginIndex, entryBB);
+  PHINode *accPhi = nullptr;
+  if (reduces) {
+    accPhi = builder->CreatePHI(doubleTy, 2, "parfor.acc");
+    accPhi->addIncoming(ConstantFP::get(*theContext, APFloat(0.0)), entryBB);
+  }
 
   // Convert the chunk-local integer index back into the source-language loop
   // value: start + index * step.
@@ -307,9 +581,39 @@ createParForWrapper(const std::string &varName, ExprAST *body,
 
   // Run the source-language body once for this iteration.
   debugInfo.emitLocation(body);
-  if (!body->codegen()) {
+  if (!reduces) {
+    body->discardResult();
+  }
+  Value *bodyVal = body->codegen();
+  Value *nextAcc = nullptr;
+  if (bodyVal && reduces) {
+    // The first iteration of the range seeds the accumulator, so operators
+    // without a known identity need none.
+    BasicBlock *firstBB = builder->GetInsertBlock();
+    BasicBlock *combineBB =
+        BasicBlock::Create(*theContext, "parfor.combine", wrapperFunc);
+    BasicBlock *accBB =
+        BasicBlock::Create(*theContext, "parfor.accumulated", wrapperFunc);
+    Value *isFirst = builder->CreateICmpEQ(indexPhi, beginIndex, "isfirst");
+    builder->CreateCondBr(isFirst, accBB, combineBB);
+
+    builder->SetInsertPoint(combineBB);
+    Value *combined = emitReduceCombine(*builder, reduceOp, accPhi, bodyVal);
+    BasicBlock *combinedBB = builder->GetInsertBlock();
+    builder->CreateBr(accBB);
+
+    builder->SetInsertPoint(accBB);
+    if (combined) {
+      PHINode *accumulated = builder->CreatePHI(doubleTy, 2, "parfor.acc.next");
+      accumulated->addIncoming(bodyVal, firstBB);
+      accumulated->addIncoming(combined, combinedBB);
+      nextAcc = accumulated;
+    }
+  }
+  if (!bodyVal || (reduces && !nextAcc)) {
     debugInfo.lexicalBlocks.pop_back();
     namedValues = std::move(savedBindings);
+    currentTaskGroup = savedTaskGroup;
     builder->restoreIP(savedIP);
     wrapperFunc->eraseFromParent();
     return nullptr;
@@ -325,9 +629,31 @@ createParForWrapper(const std::string &varName, ExprAST *body,
       builder->CreateICmpULT(nextIndex, endIndex, "parfor.cond");
   builder->CreateCondBr(continueCond, loopBB, afterBB);
   indexPhi->addIncoming(nextIndex, bodyBB);
+  if (reduces) {
+    accPhi->addIncoming(nextAcc, bodyBB);
+  }
 
   builder->SetInsertPoint(afterBB);
-  builder->CreateRetVoid();
+  PHINode *result = nullptr;
+  if (reduces) {
+    result = builder->CreatePHI(doubleTy, 2, "parfor.result");
+    result->addIncoming(ConstantFP::get(*theContext, APFloat(0.0)), entryBB);
+    result->addIncoming(nextAcc, bodyBB);
+  }
+  bool leftGroup = emitTaskGroupLeave(loc.line);
+  currentTaskGroup = savedTaskGroup;
+  if (!leftGroup) {
+    debugInfo.lexicalBlocks.pop_back();
+    namedValues = std::move(savedBindings);
+    builder->restoreIP(savedIP);
+    wrapperFunc->eraseFromParent();
+    return nullptr;
+  }
+  if (reduces) {
+    builder->CreateRet(result);
+  } else {
+    builder->CreateRetVoid();
+  }
 
   verifyFunction(*wrapperFunc);
   debugInfo.lexicalBlocks.pop_back();
@@ -531,6 +857,10 @@ Value *ForExprAST::codegen() {
   AllocaInst *oldVal = namedValues[varName];
   namedValues[varName] = alloca;
 
+  // Everything evaluated once per iteration counts as inside the loop.
+  ForLoopScope loopScope;
+
+  body->discardResult();
   if (!body->codegen()) {
     debugInfo.lexicalBlocks.pop_back();
     return nullptr;
@@ -567,6 +897,13 @@ Value *ForExprAST::codegen() {
   builder->CreateCondBr(endCond, loopBB, afterBB);
 
   builder->SetInsertPoint(afterBB);
+  if (loopScope.outermost() && asyncBatched) {
+    asyncBatched = false;
+    if (!emitAsyncFlush()) {
+      debugInfo.lexicalBlocks.pop_back();
+      return nullptr;
+    }
+  }
 
   // Restore any shadowed variable
   if (oldVal) {
@@ -631,12 +968,28 @@ Value *ParForExprAST::codegen() {
   std::vector<Type *> payloadFields(2 + captures.size(), doubleTy);
   StructType *payloadTy =
       StructType::create(*theContext, payloadFields, "parfor.payload");
-  Function *wrapperFunc =
-      createParForWrapper(varName, body.get(), captures, payloadTy, getLoc());
+  // The wrapper is a function of its own, so loops around the parfor do not
+  // batch the async calls in its body.
+  unsigned savedLoopDepth = forLoopDepth;
+  bool savedBatched = asyncBatched;
+  forLoopDepth = 0;
+  asyncBatched = false;
+  Function *wrapperFunc = createParForWrapper(varName, body.get(), reduceOp,
+                                              captures, payloadTy, getLoc());
+  forLoopDepth = savedLoopDepth;
+  asyncBatched = savedBatched;
   if (!wrapperFunc) {
     return nullptr;
   }
 
+  Function *combineFunc = nullptr;
+  if (!reduceOp.empty()) {
+    combineFunc = createReduceCombine(reduceOp, wrapperFunc->getName().str());
+    if (!combineFunc) {
+      return nullptr;
+    }
+  }
+
   // Materialize the payload on the heap so it stays valid for all scheduled
   // chunks until the runtime finishes the parallel loop.
   uint64_t payloadBytes =
@@ -662,22 +1015,53 @@ Value *ParForExprAST::codegen() {
   }
 
   // Hand the wrapper and payload to the runtime, which partitions the
-  // iteration space into chunks and waits for them before returning.
-  FunctionType *helperType =
-      FunctionType::get(doubleTy,
-                        {wrapperFunc->getType(), PointerType::get(*theContext, 0),
-                         doubleTy, doubleTy, doubleTy},
-                        false);
-  Function *helperFunc =
-      getOrCreateRuntimeFunction("__compiler_parfor", helperType);
-  if (!helperFunc) {
-    return logErrorV("Runtime function signature mismatch: __compiler_parfor");
-  }
+  // iteration space into chunks and waits for them before returning. It runs
+  // loops whose estimated cost is too small to share on the calling thread.
+  // The wrapper's own loop header directly follows its entry block.
+  uint64_t iterationCost = estimateCost(
+      wrapperFunc, wrapperFunc->getEntryBlock().getNextNode(), 0);
+  Constant *site = createCallSite(wrapperFunc->getName().str(), getLoc().line,
+                                  iterationCost);
+  Value *result = nullptr;
+  if (!combineFunc) {
+    FunctionType *helperType = FunctionType::get(
+        doubleTy,
+        {wrapperFunc->getType(), PointerType::get(*theContext, 0), doubleTy,
+         doubleTy, doubleTy, PointerType::get(*theContext, 0)},
+        false);
+    Function *helperFunc =
+        getOrCreateRuntimeFunction("__compiler_parfor", helperType);
+    if (!helperFunc) {
+      return logErrorV(
+          "Runtime function signature mismatch: __compiler_parfor");
+    }
+
+    result = builder->CreateCall(
+        helperFunc, {wrapperFunc, rawData, startVal, endVal, stepVal, site},
+        "parfortmp");
+  } else {
+    // A reduction also passes the combine function and the value of an empty
+    // loop; the runtime combines the ranges' results without locks.
+    FunctionType *helperType = FunctionType::get(
+        doubleTy,
+        {wrapperFunc->getType(), combineFunc->getType(), doubleTy,
+         PointerType::get(*theContext, 0), doubleTy, doubleTy, doubleTy,
+         PointerType::get(*theContext, 0)},
+        false);
+    Function *helperFunc =
+        getOrCreateRuntimeFunction("__compiler_parfor_reduce", helperType);
+    if (!helperFunc) {
+      return logErrorV(
+          "Runtime function signature mismatch: __compiler_parfor_reduce");
+    }
 
-  Value *result = builder->CreateCall(helperFunc,
-                                      {wrapperFunc, rawData, startVal, endVal,
-                                       stepVal},
-                                      "parfortmp");
+    Value *identity =
+        ConstantFP::get(*theContext, APFloat(reduceIdentity(reduceOp)));
+    result = builder->CreateCall(helperFunc,
+                                 {wrapperFunc, combineFunc, identity, rawData,
+                                  startVal, endVal, stepVal, site},
+                                 "parfortmp");
+  }
   // The runtime returns only after all chunks complete, so the payload can be
   // released immediately after the helper call.
   builder->CreateCall(freeFunc, {rawData});
@@ -709,8 +1093,15 @@ Value *CallExprAST::codegen() {
 Value *SyncExprAST::codegen() {
   debugInfo.emitLocation(this);
 
-  FunctionType *syncType =
-      FunctionType::get(Type::getDoubleTy(*theContext), false);
+  Value *group = getOrCreateTaskGroup();
+  if (!group) {
+    return nullptr;
+  }
+
+  // sync() only waits for the tasks this activation issued.
+  PointerType *ptrTy = PointerType::get(*theContext, 0);
+  FunctionType *syncType = FunctionType::get(Type::getDoubleTy(*theContext),
+                                             {ptrTy, ptrTy}, false);
   Function *syncFunc =
       getOrCreateRuntimeFunction("__compiler_sync_tasks", syncType);
   if (!syncFunc) {
@@ -718,19 +1109,14 @@ Value *SyncExprAST::codegen() {
         "Runtime function signature mismatch: __compiler_sync_tasks");
   }
 
-  return builder->CreateCall(syncFunc, {}, "synctmp");
+  Function *func = builder->GetInsertBlock()->getParent();
+  Constant *site = createCallSite(func->getName().str(), getLoc().line);
+  return builder->CreateCall(syncFunc, {group, site}, "synctmp");
 }
 
 Value *AsyncExprAST::codegen() {
   debugInfo.emitLocation(this);
 
-  // The async payload lives past the current function, so it must be heap
-  // allocated instead of using an alloca in the caller's stack frame.
-  Function *mallocFunc = getOrCreateMallocFunction();
-  if (!mallocFunc) {
-    return logErrorV("Could not declare malloc");
-  }
-
   // Resolve the function being scheduled.
   Function *calleeF = getFunction(callee);
   if (!calleeF) {
@@ -752,44 +1138,133 @@ Value *AsyncExprAST::codegen() {
     argValues.push_back(argVal);
   }
 
+  std::vector<Value *> afterValues;
+  afterValues.reserve(after.size());
+  for (auto &handle : after) {
+    Value *handleVal = handle->codegen();
+    if (!handleVal) {
+      return nullptr;
+    }
+    afterValues.push_back(handleVal);
+  }
+
   Type *doubleTy = Type::getDoubleTy(*theContext);
   PointerType *ptrTy = PointerType::get(*theContext, 0);
 
-  // No-argument async calls can use a null payload.
-  Value *rawData = ConstantPointerNull::get(ptrTy);
-  if (!argValues.empty()) {
-    uint64_t payloadBytes = static_cast<uint64_t>(argValues.size()) *
-                            (doubleTy->getPrimitiveSizeInBits() / 8);
-    Value *allocSize =
-        ConstantInt::get(Type::getInt64Ty(*theContext), payloadBytes);
-    rawData = builder->CreateCall(mallocFunc, {allocSize}, "asyncdata");
-    Value *doubleData = builder->CreateBitCast(rawData, ptrTy, "doubledata");
-
-    for (std::size_t i = 0; i < argValues.size(); ++i) {
-      // Write each argument into the heap payload in call order.
-      Value *index = ConstantInt::get(Type::getInt64Ty(*theContext),
-                                      static_cast<uint64_t>(i));
-      Value *argPtr =
-          builder->CreateInBoundsGEP(doubleTy, doubleData, index, "argptr");
-      builder->CreateStore(argValues[i], argPtr);
-    }
+  // The payload lives past the current function, so it goes into a task
+  // record from the runtime's recycled pool instead of the caller's frame.
+  // The record also carries the result until the handle is awaited.
+  FunctionType *allocType =
+      FunctionType::get(ptrTy, {Type::getInt64Ty(*theContext)}, false);
+  Function *allocFunc =
+      getOrCreateRuntimeFunction("__compiler_task_alloc", allocType);
+  if (!allocFunc) {
+    return logErrorV(
+        "Runtime function signature mismatch: __compiler_task_alloc");
+  }
+  Value *argCount = ConstantInt::get(Type::getInt64Ty(*theContext),
+                                     static_cast<uint64_t>(argValues.size()));
+  Value *rawData = builder->CreateCall(allocFunc, {argCount}, "asyncdata");
+  Value *doubleData = builder->CreateBitCast(rawData, ptrTy, "doubledata");
+
+  for (std::size_t i = 0; i < argValues.size(); ++i) {
+    // Write each argument into the record in call order.
+    Value *index = ConstantInt::get(Type::getInt64Ty(*theContext),
+                                    static_cast<uint64_t>(i));
+    Value *argPtr =
+        builder->CreateInBoundsGEP(doubleTy, doubleData, index, "argptr");
+    builder->CreateStore(argValues[i], argPtr);
   }
 
   // Build a wrapper that knows how to unpack the payload and call calleeF.
   Function *wrapperFunc = createAsyncWrapper(calleeF, argValues.size());
 
+  Value *group = getOrCreateTaskGroup();
+  if (!group) {
+    return nullptr;
+  }
+
   // Hand the wrapper and payload pointer off to the runtime entry
-  // point, which will queue them on the worker pool.
-  FunctionType *helperType = FunctionType::get(
-      Type::getDoubleTy(*theContext), {wrapperFunc->getType(), ptrTy}, false);
-  Function *helperFunc =
-      getOrCreateRuntimeFunction("__compiler_async_call", helperType);
+  // point, which will queue them on the worker pool under this activation's
+  // task group and return the handle. A call whose value is discarded skips
+  // the handle bookkeeping. Inside a `for` loop the runtime holds the task
+  // back and publishes a batch of them at once. A call with an `after` list
+  // is held back until those tasks finish instead, and is never batched;
+  // neither is a `high` or `low` call, which goes to its own queue.
+  std::string helperName =
+      detached ? "__compiler_async_detached" : "__compiler_async_call";
+  if (!afterValues.empty()) {
+    helperName += "_after";
+  } else if (forLoopDepth > 0 && priority.empty()) {
+    helperName += "_batched";
+    asyncBatched = true;
+  }
+  Type *countTy = Type::getInt64Ty(*theContext);
+  std::vector<Type *> helperParams = {ptrTy, wrapperFunc->getType(), ptrTy,
+                                      ptrTy};
+  if (!afterValues.empty()) {
+    helperParams.push_back(ptrTy);
+    helperParams.push_back(countTy);
+  }
+  FunctionType *helperType =
+      FunctionType::get(Type::getDoubleTy(*theContext), helperParams, false);
+  Function *helperFunc = getOrCreateRuntimeFunction(helperName, helperType);
   if (!helperFunc) {
     return logErrorV(
-        "Runtime function signature mismatch: __compiler_async_call");
+        ("Runtime function signature mismatch: " + helperName).c_str());
+  }
+
+  uint64_t priorityLevel = priority == "high" ? 1 : priority == "low" ? 2 : 0;
+  Constant *site = createCallSite(wrapperFunc->getName().str(), getLoc().line,
+                                  0, priorityLevel);
+  std::vector<Value *> helperArgs = {group, wrapperFunc, rawData, site};
+  if (!afterValues.empty()) {
+    // The runtime reads the handles before it returns, so they can live in
+    // this frame. The array goes in the entry block, so a loop reuses it.
+    Function *func = builder->GetInsertBlock()->getParent();
+    IRBuilder<> entryBuilder(&func->getEntryBlock(),
+                             func->getEntryBlock().begin());
+    ArrayType *afterTy = ArrayType::get(doubleTy, afterValues.size());
+    AllocaInst *afterArray =
+        entryBuilder.CreateAlloca(afterTy, nullptr, "after");
+    for (std::size_t i = 0; i < afterValues.size(); ++i) {
+      Value *slot = builder->CreateConstInBoundsGEP2_64(afterTy, afterArray, 0,
+                                                        i, "after.slot");
+      builder->CreateStore(afterValues[i], slot);
+    }
+    helperArgs.push_back(afterArray);
+    helperArgs.push_back(ConstantInt::get(
+        countTy, static_cast<uint64_t>(afterValues.size())));
+  }
+  return builder->CreateCall(helperFunc, helperArgs, "asynctmp");
+}
+
+Value *AwaitExprAST::codegen() {
+  Value *handle = operand->codegen();
+  if (!handle) {
+    return nullptr;
+  }
+
+  debugInfo.emitLocation(this);
+
+  Value *group = getOrCreateTaskGroup();
+  if (!group) {
+    return nullptr;
+  }
+
+  // The runtime waits for the task behind the handle and returns its result.
+  // The group lets it release the handle when it is the newest one issued.
+  FunctionType *awaitType = FunctionType::get(
+      Type::getDoubleTy(*theContext),
+      {PointerType::get(*theContext, 0), Type::getDoubleTy(*theContext)},
+      false);
+  Function *awaitFunc =
+      getOrCreateRuntimeFunction("__compiler_await", awaitType);
+  if (!awaitFunc) {
+    return logErrorV("Runtime function signature mismatch: __compiler_await");
   }
 
-  return builder->CreateCall(helperFunc, {wrapperFunc, rawData}, "asynctmp");
+  return builder->CreateCall(awaitFunc, {group, handle}, "awaittmp");
 }
 
 Function *PrototypeAST::codegen() {
@@ -849,6 +1324,9 @@ Function *FunctionAST::codegen() {
   // Create a new basic block to start insertion into
   BasicBlock *basicBlock = BasicBlock::Create(*theContext, "entry", func);
   builder->SetInsertPoint(basicBlock);
+  currentTaskGroup = nullptr;
+  forLoopDepth = 0;
+  asyncBatched = false;
   debugInfo.emitLocation(nullptr);
 
   // Record the function arguments in the named values map
@@ -869,7 +1347,8 @@ Function *FunctionAST::codegen() {
   }
 
   debugInfo.emitLocation(body.get());
-  if (Value *retVal = body->codegen()) {
+  Value *retVal = body->codegen();
+  if (retVal && emitTaskGroupLeave(protoLoc.line)) {
     // Finish the function by creating ret
     builder->CreateRet(retVal);
 
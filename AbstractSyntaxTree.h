@@ -32,6 +32,8 @@ public:
   virtual ~ExprAST() = default;
   SourceLocation getLoc() const { return loc; }
   virtual Value *codegen() = 0;
+  // Called before codegen when the expression's value is never used.
+  virtual void discardResult() {}
 };
 
 class NumberExprAST : public ExprAST {
@@ -149,20 +151,24 @@ class ParForExprAST : public ExprAST {
   std::unique_ptr<ExprAST> startExpr;
   std::unique_ptr<ExprAST> endExpr;
   std::unique_ptr<ExprAST> stepExpr;
+  // Reduction operator ("+", "*", "min", "max", or a user-defined binary
+  // operator character), or empty for a loop that returns 0.0.
+  std::string reduceOp;
   std::unique_ptr<ExprAST> body;
 
 public:
   ParForExprAST(const std::string &varName, std::unique_ptr<ExprAST> startExpr,
                 std::unique_ptr<ExprAST> endExpr,
-                std::unique_ptr<ExprAST> stepExpr,
+                std::unique_ptr<ExprAST> stepExpr, const std::string &reduceOp,
                 std::unique_ptr<ExprAST> body, SourceLocation loc)
       : ExprAST(loc), varName(varName), startExpr(std::move(startExpr)),
         endExpr(std::move(endExpr)), stepExpr(std::move(stepExpr)),
-        body(std::move(body)) {}
+        reduceOp(reduceOp), body(std::move(body)) {}
   const std::string &getVarName() const { return varName; }
   const ExprAST *getStartExpr() const { return startExpr.get(); }
   const ExprAST *getEndExpr() const { return endExpr.get(); }
   const ExprAST *getStepExpr() const { return stepExpr.get(); }
+  const std::string &getReduceOp() const { return reduceOp; }
   const ExprAST *getBody() const { return body.get(); }
   std::unique_ptr<ExprAST> takeStartExpr() { return std::move(startExpr); }
   std::unique_ptr<ExprAST> takeEndExpr() { return std::move(endExpr); }
@@ -195,14 +201,38 @@ public:
 class AsyncExprAST : public ExprAST {
   std::string callee;
   std::vector<std::unique_ptr<ExprAST>> args;
+  // Handles of the tasks that must finish before this one starts.
+  std::vector<std::unique_ptr<ExprAST>> after;
+  // "high", "low", or empty for normal priority.
+  std::string priority;
+  // No handle is needed when nothing can await the call.
+  bool detached = false;
 
 public:
   AsyncExprAST(std::string &callee, std::vector<std::unique_ptr<ExprAST>> args,
-               SourceLocation loc)
-      : ExprAST(loc), callee(callee), args(std::move(args)) {}
+               std::vector<std::unique_ptr<ExprAST>> after,
+               const std::string &priority, SourceLocation loc)
+      : ExprAST(loc), callee(callee), args(std::move(args)),
+        after(std::move(after)), priority(priority) {}
   const std::string &getCallee() const { return callee; }
   const auto &getArgs() const { return args; }
   auto takeArgs() { return std::move(args); }
+  const auto &getAfter() const { return after; }
+  auto takeAfter() { return std::move(after); }
+  const std::string &getPriority() const { return priority; }
+  Value *codegen() override;
+  void discardResult() override { detached = true; }
+};
+
+// Waits for the task behind an async handle and yields its result
+class AwaitExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> operand;
+
+public:
+  AwaitExprAST(std::unique_ptr<ExprAST> operand, SourceLocation loc)
+      : ExprAST(loc), operand(std::move(operand)) {}
+  const ExprAST *getOperand() const { return operand.get(); }
+  std::unique_ptr<ExprAST> takeOperand() { return std::move(operand); }
   Value *codegen() override;
 };
 
@@ -98,6 +98,9 @@ int gettok() {
     if (identifierStr == "async") {
       return tok_async;
     }
+    if (identifierStr == "await") {
+      return tok_await;
+    }
     return tok_identifier;
   }
 
@@ -32,6 +32,7 @@ enum token {
   tok_sync = -14,
   tok_async = -15,
   tok_parfor = -16,
+  tok_await = -17,
 };
 
 extern int curTok;                // Current token
@@ -3,21 +3,39 @@
 #include "LogErrors.h"
 #include "Parser.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Metadata.h"
+#include "llvm/MC/MCSubtargetInfo.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/SubtargetFeature.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <system_error>
+#include <unistd.h>
+#include <vector>
 
 namespace Compiler {
 
@@ -27,14 +45,48 @@ struct InputConfig {
   FILE *stream = nullptr;
   std::string sourceName;
   std::string outputName;
+  // IR optimization level, from -O0 (the default) to -O3.
+  unsigned optLevel = 0;
+  // -mcpu: "native" (the default) for the host CPU and its features, or an
+  // LLVM CPU name such as "generic" or "x86-64-v3".
+  std::string cpu = "native";
+  // -mattr: comma-separated features such as "+avx2,-avx512f", applied on
+  // top of the CPU's.
+  std::string features;
+  // -multiversion: functions compiled once per entry of `versions`, of which
+  // the program calls the best one its CPU supports.
+  std::vector<std::string> multiversioned;
+  // -mversions: the x86-64 levels to compile them for, lowest first.
+  std::vector<std::string> versions = {"x86-64", "x86-64-v3", "x86-64-v4"};
+  // --run: compile the program in memory and run its main, instead of
+  // writing an object file.
+  bool run = false;
+  // --repl: read definitions and expressions interactively, after those of
+  // the source file if one is given.
+  bool repl = false;
 };
 
+// CPUs a function can be versioned for, by the level __compiler_cpu_level in
+// runtime.cpp reports for them, starting at 1.
+const char *const kVersionCpus[] = {"x86-64", "x86-64-v2", "x86-64-v3",
+                                    "x86-64-v4"};
+
+// Returns the level of a -mversions entry, or 0 when it is not one.
+unsigned versionLevel(const std::string &cpu) {
+  for (unsigned i = 0; i < std::size(kVersionCpus); ++i) {
+    if (cpu == kVersionCpus[i]) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
 struct CompileStatus {
   bool hasMain = false;
 };
 
 void initializeModule(const std::string &sourceName);
-bool emitObjectFile(const std::string &filename);
+bool emitObjectFile(const InputConfig &config);
 
 std::string makeOutputFilename(const std::string &sourceName) {
   std::size_t lastSlash = sourceName.find_last_of("/\\");
@@ -68,13 +120,16 @@ void initializeModule(const std::string &sourceName) {
   initializeDebugInfo(sourceName);
 }
 
-void setup(const InputConfig &config) {
-  // Install standard binary operators
+void installBinaryOperators() {
   // 1 is lowest precedence
   binopPrecedence['<'] = 10;
   binopPrecedence['+'] = 20;
   binopPrecedence['-'] = 20;
   binopPrecedence['*'] = 40; // highest
+}
+
+void setup(const InputConfig &config) {
+  installBinaryOperators();
 
   setInputFile(config.stream);
 
@@ -85,8 +140,210 @@ void setup(const InputConfig &config) {
   getNextToken();
 }
 
-bool emitObjectFile(const std::string &filename) {
-  finalizeDebugInfo();
+// Runs LLVM's default pipeline for `optLevel` over `module`, as clang does
+// for the same -O flag. -O0 only runs the passes that must always run.
+void optimizeModule(llvm::Module &module, llvm::TargetMachine &targetMachine,
+                    unsigned optLevel) {
+  static const llvm::OptimizationLevel levels[] = {
+      llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1,
+      llvm::OptimizationLevel::O2, llvm::OptimizationLevel::O3};
+  llvm::OptimizationLevel level = levels[optLevel];
+
+  llvm::LoopAnalysisManager loopAnalyses;
+  llvm::FunctionAnalysisManager functionAnalyses;
+  llvm::CGSCCAnalysisManager cgsccAnalyses;
+  llvm::ModuleAnalysisManager moduleAnalyses;
+  llvm::PassBuilder passBuilder(&targetMachine);
+  passBuilder.registerModuleAnalyses(moduleAnalyses);
+  passBuilder.registerCGSCCAnalyses(cgsccAnalyses);
+  passBuilder.registerFunctionAnalyses(functionAnalyses);
+  passBuilder.registerLoopAnalyses(loopAnalyses);
+  passBuilder.crossRegisterProxies(loopAnalyses, functionAnalyses,
+                                   cgsccAnalyses, moduleAnalyses);
+
+  llvm::ModulePassManager passes =
+      optLevel == 0 ? passBuilder.buildO0DefaultPipeline(level)
+                    : passBuilder.buildPerModuleDefaultPipeline(level);
+  passes.run(module, moduleAnalyses);
+}
+
+// Turns -mcpu and -mattr into the CPU name and feature string LLVM takes.
+void resolveTarget(const InputConfig &config, std::string &cpu,
+                   std::string &features) {
+  llvm::SubtargetFeatures subtarget;
+  cpu = config.cpu;
+  if (cpu == "native") {
+    cpu = llvm::sys::getHostCPUName().str();
+    for (const auto &feature : llvm::sys::getHostCPUFeatures()) {
+      subtarget.AddFeature(feature.getKey(), feature.getValue());
+    }
+  }
+  llvm::SubtargetFeatures requested(config.features);
+  for (const std::string &feature : requested.getFeatures()) {
+    subtarget.AddFeature(feature);
+  }
+  features = subtarget.getString();
+}
+
+// Records the target on every function, so the IR passes see the same CPU
+// and features as code generation; the vectorizers size vectors from them.
+void setTargetAttributes(const std::string &cpu, const std::string &features) {
+  for (llvm::Function &function : *theModule) {
+    if (function.isDeclaration()) {
+      continue;
+    }
+    function.addFnAttr("target-cpu", cpu);
+    if (!features.empty()) {
+      function.addFnAttr("target-features", features);
+    }
+  }
+}
+
+// Collects `function` and, transitively, the private functions it refers
+// to: the async and parfor wrappers its body was split into.
+void collectVersioned(llvm::Function *function,
+                      llvm::SetVector<llvm::Function *> &versioned) {
+  if (!versioned.insert(function)) {
+    return;
+  }
+  for (llvm::Instruction &inst : llvm::instructions(*function)) {
+    for (llvm::Value *operand : inst.operands()) {
+      auto *callee = llvm::dyn_cast<llvm::Function>(operand);
+      if (callee && callee->hasPrivateLinkage() && !callee->isDeclaration()) {
+        collectVersioned(callee, versioned);
+      }
+    }
+  }
+}
+
+// Gives `function` a body that passes its arguments on to the function
+// `slot` points to, as a tail call.
+void emitForwardingStub(llvm::Function &function, llvm::GlobalVariable &slot) {
+  llvm::IRBuilder<> stub(
+      llvm::BasicBlock::Create(function.getContext(), "entry", &function));
+  std::vector<llvm::Value *> args;
+  for (llvm::Argument &arg : function.args()) {
+    args.push_back(&arg);
+  }
+  llvm::Value *target = stub.CreateLoad(slot.getValueType(), &slot, "target");
+  llvm::CallInst *call =
+      stub.CreateCall(function.getFunctionType(), target, args);
+  call->setTailCall();
+  stub.CreateRet(call);
+}
+
+// Compiles each -multiversion function, with its wrappers, once per
+// -mversions level as `<name>.<cpu>`. The function itself becomes a stub
+// that calls through the `<name>.version` pointer, which a constructor sets
+// as the program loads to the highest version the CPU supports.
+bool multiversionFunctions(const InputConfig &config,
+                           const llvm::Triple &triple) {
+  if (triple.getArch() != llvm::Triple::x86_64) {
+    llvm::errs() << "-multiversion needs an x86-64 target, not "
+                 << triple.str() << '\n';
+    return false;
+  }
+
+  std::vector<llvm::Function *> entries;
+  llvm::SetVector<llvm::Function *> versioned;
+  for (const std::string &name : config.multiversioned) {
+    llvm::Function *function = theModule->getFunction(name);
+    if (!function || function->isDeclaration()) {
+      llvm::errs() << "-multiversion: no function named " << name << '\n';
+      return false;
+    }
+    if (!versioned.contains(function)) {
+      entries.push_back(function);
+      collectVersioned(function, versioned);
+    }
+  }
+
+  std::string features = llvm::SubtargetFeatures(config.features).getString();
+  std::vector<llvm::DenseMap<llvm::Function *, llvm::Function *>> clones(
+      config.versions.size());
+  for (std::size_t v = 0; v < config.versions.size(); ++v) {
+    const std::string &cpu = config.versions[v];
+    for (llvm::Function *function : versioned) {
+      llvm::ValueToValueMapTy values;
+      llvm::Function *clone = llvm::CloneFunction(function, values);
+      clone->setName(function->getName() + "." + cpu);
+      clone->addFnAttr("target-cpu", cpu);
+      clone->removeFnAttr("target-features");
+      if (!features.empty()) {
+        clone->addFnAttr("target-features", features);
+      }
+      clones[v][function] = clone;
+    }
+    // Each version calls and spawns the same version of everything
+    // versioned with it, itself included.
+    for (auto &entry : clones[v]) {
+      for (llvm::Instruction &inst : llvm::instructions(*entry.second)) {
+        for (llvm::Use &operand : inst.operands()) {
+          auto *callee = llvm::dyn_cast<llvm::Function>(operand.get());
+          if (llvm::Function *version = callee ? clones[v].lookup(callee)
+                                               : nullptr) {
+            operand.set(version);
+          }
+        }
+      }
+    }
+  }
+
+  llvm::Type *levelTy = llvm::Type::getInt32Ty(*theContext);
+  llvm::PointerType *ptrTy = llvm::PointerType::get(*theContext, 0);
+  llvm::FunctionCallee cpuLevel =
+      theModule->getOrInsertFunction("__compiler_cpu_level", levelTy);
+  llvm::Function *selector = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(*theContext), false),
+      llvm::Function::InternalLinkage, "__compiler_select_versions",
+      theModule.get());
+  llvm::IRBuilder<> select(
+      llvm::BasicBlock::Create(*theContext, "entry", selector));
+  llvm::Value *level = select.CreateCall(cpuLevel, {}, "level");
+
+  for (llvm::Function *function : entries) {
+    // Until the constructor runs, calls get the lowest version. Nothing
+    // outside the object needs the pointer, so it does not export it.
+    auto *slot = new llvm::GlobalVariable(
+        *theModule, ptrTy, false, llvm::GlobalValue::InternalLinkage,
+        clones[0][function], function->getName() + ".version");
+    llvm::Value *chosen = clones[0][function];
+    for (std::size_t v = 1; v < config.versions.size(); ++v) {
+      llvm::Value *supported = select.CreateICmpUGE(
+          level,
+          llvm::ConstantInt::get(levelTy, versionLevel(config.versions[v])));
+      chosen = select.CreateSelect(supported, clones[v][function], chosen);
+    }
+    select.CreateStore(chosen, slot);
+
+    function->deleteBody();
+    emitForwardingStub(*function, *slot);
+  }
+  select.CreateRetVoid();
+  // Priorities up to 100 are reserved for the implementation; 65535 is the
+  // one an unprioritized C or C++ constructor gets.
+  llvm::appendToGlobalCtors(*theModule, selector, 65535);
+
+  // The original wrappers were only used by the bodies just replaced. A
+  // nested wrapper goes once the one that refers to it has.
+  std::vector<llvm::Function *> unused(versioned.begin(), versioned.end());
+  for (bool erased = true; erased;) {
+    erased = false;
+    for (llvm::Function *&function : unused) {
+      if (function && function->hasPrivateLinkage() && function->use_empty()) {
+        function->eraseFromParent();
+        function = nullptr;
+        erased = true;
+      }
+    }
+  }
+  return true;
+}
+
+// Creates the target machine for the host triple and the configured CPU,
+// features, and level, or returns null on error.
+std::unique_ptr<llvm::TargetMachine>
+createTargetMachine(const InputConfig &config) {
   InitializeAllTargetInfos();
   InitializeAllTargets();
   InitializeAllTargetMCs();
@@ -95,28 +352,70 @@ bool emitObjectFile(const std::string &filename) {
 
   std::string targetTripleStr = llvm::sys::getDefaultTargetTriple();
   llvm::Triple targetTriple(targetTripleStr);
-  theModule->setTargetTriple(targetTriple);
 
   std::string error;
   auto *target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
   if (!target) {
     llvm::errs() << error << '\n';
-    return false;
+    return nullptr;
   }
 
-  auto CPU = "generic";
-  auto features = "";
+  std::string cpu;
+  std::string features;
+  resolveTarget(config, cpu, features);
 
   llvm::TargetOptions options;
   auto relocationModel = std::optional<llvm::Reloc::Model>(llvm::Reloc::PIC_);
+  static const llvm::CodeGenOptLevel codeGenLevels[] = {
+      llvm::CodeGenOptLevel::None, llvm::CodeGenOptLevel::Less,
+      llvm::CodeGenOptLevel::Default, llvm::CodeGenOptLevel::Aggressive};
   std::unique_ptr<llvm::TargetMachine> targetMachine(
-      target->createTargetMachine(targetTriple, CPU, features, options,
-                                  relocationModel));
+      target->createTargetMachine(targetTriple, cpu, features, options,
+                                  relocationModel, std::nullopt,
+                                  codeGenLevels[config.optLevel]));
+  if (!targetMachine->getMCSubtargetInfo()->isCPUStringValid(cpu)) {
+    llvm::errs() << "Unknown CPU for " << targetTriple.str() << ": " << cpu
+                 << '\n';
+    return nullptr;
+  }
+  return targetMachine;
+}
+
+// Targets the finished module at `targetMachine`.
+void targetModule(llvm::TargetMachine &targetMachine) {
+  finalizeDebugInfo();
+  theModule->setTargetTriple(targetMachine.getTargetTriple());
+  theModule->setDataLayout(targetMachine.createDataLayout());
+  setTargetAttributes(targetMachine.getTargetCPU().str(),
+                      targetMachine.getTargetFeatureString().str());
+}
+
+// Targets the module at the configured CPU and runs the IR passes over it.
+// Returns the target machine to generate code with, or null on error.
+std::unique_ptr<llvm::TargetMachine> prepareModule(const InputConfig &config) {
+  std::unique_ptr<llvm::TargetMachine> targetMachine =
+      createTargetMachine(config);
+  if (!targetMachine) {
+    return nullptr;
+  }
+  targetModule(*targetMachine);
+  if (!config.multiversioned.empty() &&
+      !multiversionFunctions(config, targetMachine->getTargetTriple())) {
+    return nullptr;
+  }
+  optimizeModule(*theModule, *targetMachine, config.optLevel);
+  return targetMachine;
+}
 
-  theModule->setDataLayout(targetMachine->createDataLayout());
+bool emitObjectFile(const InputConfig &config) {
+  std::unique_ptr<llvm::TargetMachine> targetMachine = prepareModule(config);
+  if (!targetMachine) {
+    return false;
+  }
 
   std::error_code errorCode;
-  llvm::raw_fd_ostream dest(filename, errorCode, llvm::sys::fs::OF_None);
+  llvm::raw_fd_ostream dest(config.outputName, errorCode,
+                            llvm::sys::fs::OF_None);
   if (errorCode) {
     llvm::errs() << "Could not open file: " << errorCode.message() << '\n';
     return false;
@@ -131,7 +430,335 @@ bool emitObjectFile(const std::string &filename) {
 
   pass.run(*theModule);
   dest.flush();
-  llvm::outs() << "Wrote " << filename << '\n';
+  llvm::outs() << "Wrote " << config.outputName << '\n';
+  return true;
+}
+
+bool reportError(llvm::Error error) {
+  llvm::logAllUnhandledErrors(std::move(error), llvm::errs());
+  return false;
+}
+
+// Describes `targetMachine` to ORC, which creates its own from it.
+llvm::orc::JITTargetMachineBuilder
+jitMachineFor(const llvm::TargetMachine &targetMachine) {
+  llvm::orc::JITTargetMachineBuilder machineBuilder(
+      targetMachine.getTargetTriple());
+  machineBuilder.setCPU(targetMachine.getTargetCPU().str());
+  machineBuilder.getFeatures() =
+      llvm::SubtargetFeatures(targetMachine.getTargetFeatureString());
+  machineBuilder.setOptions(targetMachine.Options);
+  machineBuilder.setRelocationModel(llvm::Reloc::PIC_);
+  machineBuilder.setCodeGenOptLevel(targetMachine.getOptLevel());
+  return machineBuilder;
+}
+
+// Lets JIT code call the runtime linked into the compiler and any other
+// symbol this process exports.
+llvm::Error addProcessSymbols(llvm::orc::LLJIT &jit) {
+  auto processSymbols =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          jit.getDataLayout().getGlobalPrefix());
+  if (!processSymbols) {
+    return processSymbols.takeError();
+  }
+  jit.getMainJITDylib().addGenerator(std::move(*processSymbols));
+  return llvm::Error::success();
+}
+
+// Compiles the module in memory with ORC's LLJIT, for the same target and
+// level an object file would get, and calls the program's main. Runtime
+// entry points such as __compiler_async_call resolve to the runtime linked
+// into the compiler, and externs to any other symbol of this process, so
+// the compiler must be linked with its symbols exported.
+bool runProgram(const InputConfig &config, double &result) {
+  std::unique_ptr<llvm::TargetMachine> targetMachine = prepareModule(config);
+  if (!targetMachine) {
+    return false;
+  }
+
+  auto jit = llvm::orc::LLJITBuilder()
+                 .setJITTargetMachineBuilder(jitMachineFor(*targetMachine))
+                 .create();
+  if (!jit) {
+    return reportError(jit.takeError());
+  }
+  llvm::orc::JITDylib &library = (*jit)->getMainJITDylib();
+  if (llvm::Error error = addProcessSymbols(**jit)) {
+    return reportError(std::move(error));
+  }
+
+  // The JIT owns the module and its context from here on.
+  builder.reset();
+  llvm::orc::ThreadSafeModule module(std::move(theModule),
+                                     std::move(theContext));
+  if (llvm::Error error = (*jit)->addIRModule(std::move(module))) {
+    return reportError(std::move(error));
+  }
+  // Runs the module's constructors, such as the -multiversion selector.
+  if (llvm::Error error = (*jit)->initialize(library)) {
+    return reportError(std::move(error));
+  }
+  auto entry = (*jit)->lookup("__program_main");
+  if (!entry) {
+    return reportError(entry.takeError());
+  }
+  result = entry->toPtr<double (*)()>()();
+  if (llvm::Error error = (*jit)->deinitialize(library)) {
+    return reportError(std::move(error));
+  }
+  // The runtime writes its trace and tuning file at exit from call sites that
+  // live in JIT memory, so the JIT is leaked on purpose rather than destroyed.
+  (*jit).release();
+  return true;
+}
+
+// A --repl session. Every definition goes into a module of its own, which
+// LLLazyJIT compiles one function at a time, on its first call, so loading
+// many definitions costs little more than parsing them. A name is bound
+// once, to a stub that calls through `<name>.current`; a redefinition is
+// added as `<name>.<n>` and that pointer moved to it, so code compiled
+// against an earlier definition calls the new one.
+class Repl {
+public:
+  static std::unique_ptr<Repl> create(const InputConfig &config);
+
+  // Adds `function`, replacing any earlier definition of its name. Returns
+  // false on error.
+  bool define(FunctionAST &function);
+  // Compiles and runs a top-level expression.
+  bool evaluate(FunctionAST &expression, double &result);
+
+private:
+  struct Definition {
+    std::size_t arity;
+    unsigned version;
+  };
+
+  Repl(const InputConfig &config,
+       std::unique_ptr<llvm::TargetMachine> targetMachine,
+       std::unique_ptr<llvm::orc::LLLazyJIT> jit)
+      : config(config), targetMachine(std::move(targetMachine)),
+        jit(std::move(jit)) {}
+
+  // Hands the finished module over to the JIT.
+  llvm::orc::ThreadSafeModule takeModule();
+
+  const InputConfig &config;
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  std::unique_ptr<llvm::orc::LLLazyJIT> jit;
+  std::map<std::string, Definition> definitions;
+  // Numbers the expressions, which are named `__anon_expr.N`.
+  unsigned expressions = 0;
+  // Functions compile on the JIT's thread and expressions on this one; both
+  // optimize with `targetMachine`.
+  std::mutex optimizeMutex;
+};
+
+std::unique_ptr<Repl> Repl::create(const InputConfig &config) {
+  std::unique_ptr<llvm::TargetMachine> targetMachine =
+      createTargetMachine(config);
+  if (!targetMachine) {
+    return nullptr;
+  }
+  // A compile thread of its own gives each compile a fresh target machine,
+  // so tasks on several workers can reach functions not compiled yet.
+  auto jit = llvm::orc::LLLazyJITBuilder()
+                 .setJITTargetMachineBuilder(jitMachineFor(*targetMachine))
+                 .setNumCompileThreads(1)
+                 .create();
+  if (!jit) {
+    reportError(jit.takeError());
+    return nullptr;
+  }
+  if (llvm::Error error = addProcessSymbols(**jit)) {
+    reportError(std::move(error));
+    return nullptr;
+  }
+
+  std::unique_ptr<Repl> repl(
+      new Repl(config, std::move(targetMachine), std::move(*jit)));
+  // The IR passes run as each function compiles, not as it is defined.
+  Repl *session = repl.get();
+  session->jit->getIRTransformLayer().setTransform(
+      [session](llvm::orc::ThreadSafeModule module,
+                llvm::orc::MaterializationResponsibility &)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        module.withModuleDo([session](llvm::Module &partition) {
+          std::lock_guard<std::mutex> lock(session->optimizeMutex);
+          optimizeModule(partition, *session->targetMachine,
+                         session->config.optLevel);
+        });
+        return std::move(module);
+      });
+  return repl;
+}
+
+llvm::orc::ThreadSafeModule Repl::takeModule() {
+  targetModule(*targetMachine);
+  builder.reset();
+  return llvm::orc::ThreadSafeModule(std::move(theModule),
+                                     std::move(theContext));
+}
+
+bool Repl::define(FunctionAST &function) {
+  const PrototypeAST &proto = function.getProto();
+  std::string symbol = proto.getSymbolName();
+  auto existing = definitions.find(symbol);
+  // Callers compiled against the stub pass the old number of arguments.
+  if (existing != definitions.end() &&
+      existing->second.arity != proto.getArgs().size()) {
+    llvm::errs() << "Error: " << proto.getName() << " already takes "
+                 << existing->second.arity << " argument(s)\n";
+    return false;
+  }
+
+  functionProtos[proto.getName()] = proto.clone();
+  initializeModule(config.sourceName);
+  llvm::Function *body = function.codegen();
+  if (!body) {
+    return false;
+  }
+  unsigned version =
+      existing == definitions.end() ? 1 : existing->second.version + 1;
+  std::string bodyName = symbol + "." + std::to_string(version);
+  body->setName(bodyName);
+  if (version == 1) {
+    auto *slot = new llvm::GlobalVariable(
+        *theModule, llvm::PointerType::get(*theContext, 0), false,
+        llvm::GlobalValue::ExternalLinkage, body, symbol + ".current");
+    llvm::Function *stub =
+        llvm::Function::Create(body->getFunctionType(),
+                               llvm::Function::ExternalLinkage, symbol,
+                               theModule.get());
+    emitForwardingStub(*stub, *slot);
+  }
+
+  if (llvm::Error error = jit->addLazyIRModule(takeModule())) {
+    return reportError(std::move(error));
+  }
+  if (version > 1) {
+    // Looking the body up gives its lazy stub; nothing compiles yet.
+    auto slot = jit->lookup(symbol + ".current");
+    if (!slot) {
+      return reportError(slot.takeError());
+    }
+    auto target = jit->lookup(bodyName);
+    if (!target) {
+      return reportError(target.takeError());
+    }
+    *slot->toPtr<void **>() = target->toPtr<void *>();
+  }
+  definitions[symbol] = {proto.getArgs().size(), version};
+  return true;
+}
+
+bool Repl::evaluate(FunctionAST &expression, double &result) {
+  initializeModule(config.sourceName);
+  llvm::Function *function = expression.codegen();
+  if (!function) {
+    return false;
+  }
+  // Tasks and loops leave call sites and wrapper addresses with the runtime,
+  // which its trace and tuner use until exit, so such an expression stays.
+  bool usesRuntime = false;
+  for (const llvm::Function &callee : *theModule) {
+    if (callee.isDeclaration() &&
+        callee.getName().starts_with("__compiler_")) {
+      usesRuntime = true;
+      break;
+    }
+  }
+  std::string name = "__anon_expr." + std::to_string(++expressions);
+  function->setName(name);
+  // Compiled right away, since it runs right away, and removed after
+  // unless it has to stay.
+  llvm::orc::ResourceTrackerSP tracker =
+      jit->getMainJITDylib().createResourceTracker();
+  if (llvm::Error error = jit->addIRModule(tracker, takeModule())) {
+    return reportError(std::move(error));
+  }
+  auto entry = jit->lookup(name);
+  if (!entry) {
+    return reportError(entry.takeError());
+  }
+  result = entry->toPtr<double (*)()>()();
+  if (usesRuntime) {
+    return true;
+  }
+  if (llvm::Error error = tracker->remove()) {
+    return reportError(std::move(error));
+  }
+  return true;
+}
+
+// Feeds definitions, externs, and expressions to `repl` until the input
+// ends, printing the value of each expression. Items are separated by `;`,
+// which at the prompt ends an expression without waiting for the next line.
+void replLoop(Repl &repl, bool prompt) {
+  if (prompt) {
+    fprintf(stderr, "ready> ");
+  }
+  getNextToken();
+  while (true) {
+    hadError = false;
+    switch (curTok) {
+    case tok_eof:
+      return;
+    case ';':
+      if (prompt) {
+        fprintf(stderr, "ready> ");
+      }
+      getNextToken();
+      break;
+    case tok_def:
+      if (auto funcAST = parseDefinition()) {
+        if (!hadError) {
+          repl.define(*funcAST);
+        }
+      } else {
+        // Skip token for error recovery
+        getNextToken();
+      }
+      break;
+    case tok_extern:
+      if (auto protoAST = parseExtern()) {
+        functionProtos[protoAST->getName()] = std::move(protoAST);
+      } else {
+        getNextToken();
+      }
+      break;
+    default:
+      if (auto exprAST = parseTopLevelExpr()) {
+        double result = 0.0;
+        if (!hadError && repl.evaluate(*exprAST, result)) {
+          std::printf("%.12f\n", result);
+          std::fflush(stdout);
+        }
+      } else {
+        getNextToken();
+      }
+      break;
+    }
+  }
+}
+
+// Loads the source file, if any, then reads standard input, at a prompt
+// when that is a terminal.
+bool runRepl(const InputConfig &config) {
+  std::unique_ptr<Repl> repl = Repl::create(config);
+  if (!repl) {
+    return false;
+  }
+  installBinaryOperators();
+  if (config.stream) {
+    setInputFile(config.stream);
+    replLoop(*repl, false);
+  }
+  setInputFile(stdin);
+  replLoop(*repl, isatty(fileno(stdin)));
+  // Like `--run`, the JIT outlives the runtime's trace and tuning file.
+  repl.release();
   return true;
 }
 
@@ -171,14 +798,93 @@ void mainLoop(const InputConfig &config, CompileStatus &status) {
   }
 }
 
+// Splits a comma-separated flag value, dropping empty items.
+std::vector<std::string> splitList(const char *text) {
+  std::vector<std::string> items;
+  std::string item;
+  for (const char *c = text;; ++c) {
+    if (*c == ',' || *c == '\0') {
+      if (!item.empty()) {
+        items.push_back(item);
+      }
+      item.clear();
+      if (*c == '\0') {
+        return items;
+      }
+    } else {
+      item += *c;
+    }
+  }
+}
+
 InputConfig parseInputConfig(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <source-file>\n", argv[0]);
+  InputConfig config;
+  const char *path = nullptr;
+  bool usage = false;
+  bool cpuGiven = false;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (std::strlen(arg) == 3 && arg[0] == '-' && arg[1] == 'O' &&
+        arg[2] >= '0' && arg[2] <= '3') {
+      config.optLevel = static_cast<unsigned>(arg[2] - '0');
+    } else if (std::strncmp(arg, "-mcpu=", 6) == 0 && arg[6] != '\0') {
+      config.cpu = arg + 6;
+      cpuGiven = true;
+    } else if (std::strncmp(arg, "-mattr=", 7) == 0) {
+      config.features = arg + 7;
+    } else if (std::strncmp(arg, "-multiversion=", 14) == 0) {
+      config.multiversioned = splitList(arg + 14);
+    } else if (std::strcmp(arg, "--run") == 0) {
+      config.run = true;
+    } else if (std::strcmp(arg, "--repl") == 0) {
+      config.repl = true;
+    } else if (std::strncmp(arg, "-mversions=", 11) == 0) {
+      config.versions = splitList(arg + 11);
+      for (const std::string &cpu : config.versions) {
+        if (!versionLevel(cpu)) {
+          fprintf(stderr, "-mversions: %s is not x86-64 or x86-64-v2 to v4\n",
+                  cpu.c_str());
+          std::exit(1);
+        }
+      }
+      std::sort(config.versions.begin(), config.versions.end(),
+                [](const std::string &a, const std::string &b) {
+                  return versionLevel(a) < versionLevel(b);
+                });
+      config.versions.erase(
+          std::unique(config.versions.begin(), config.versions.end()),
+          config.versions.end());
+      usage = config.versions.empty();
+    } else if (arg[0] == '-' || path) {
+      usage = true;
+    } else {
+      path = arg;
+    }
+  }
+  // The REPL neither versions functions nor runs a whole program.
+  if (config.repl && (config.run || !config.multiversioned.empty())) {
+    usage = true;
+  }
+  if (usage || (!path && !config.repl)) {
+    fprintf(stderr,
+            "Usage: %s [-O0|-O1|-O2|-O3] [-mcpu=<cpu>|native] "
+            "[-mattr=<+feature,-feature>] [-multiversion=<function,...>] "
+            "[-mversions=<x86-64-level,...>] [--run] <source-file>\n"
+            "       %s [-O0|-O1|-O2|-O3] [-mcpu=<cpu>|native] "
+            "[-mattr=<+feature,-feature>] --repl [<source-file>]\n",
+            argv[0], argv[0]);
     std::exit(1);
   }
+  // Code outside the versioned functions has to run wherever the lowest
+  // version does.
+  if (!config.multiversioned.empty() && !cpuGiven) {
+    config.cpu = config.versions.front();
+  }
+  if (!path) {
+    config.sourceName = "<stdin>";
+    return config;
+  }
 
-  InputConfig config;
-  const char *path = argv[1];
   FILE *file = fopen(path, "r");
   if (!file) {
     perror(path);
@@ -195,6 +901,13 @@ InputConfig parseInputConfig(int argc, char **argv) {
 
 int main(int argc, char **argv) {
   Compiler::InputConfig inputConfig = Compiler::parseInputConfig(argc, argv);
+  if (inputConfig.repl) {
+    bool ok = Compiler::runRepl(inputConfig);
+    if (inputConfig.stream) {
+      fclose(inputConfig.stream);
+    }
+    return ok ? 0 : 1;
+  }
   Compiler::CompileStatus compileStatus;
   Compiler::hadError = false;
   Compiler::mainLoop(inputConfig, compileStatus);
@@ -204,7 +917,20 @@ int main(int argc, char **argv) {
   if (Compiler::hadError) {
     return 1;
   }
-  if (!Compiler::emitObjectFile(inputConfig.outputName)) {
+  if (inputConfig.run) {
+    if (!compileStatus.hasMain) {
+      llvm::errs() << "--run needs a program entrypoint: def main()\n";
+      return 1;
+    }
+    double result = 0.0;
+    if (!Compiler::runProgram(inputConfig, result)) {
+      return 1;
+    }
+    // The same line tools/driver.cpp prints.
+    std::printf("Program result = %.12f\n", result);
+    return 0;
+  }
+  if (!Compiler::emitObjectFile(inputConfig)) {
     return 1;
   }
   llvm::outs() << "Entrypoint: "
@@ -81,6 +81,7 @@ bool isPure(const ExprAST *expr) {
   if (dynamic_cast<const CallExprAST *>(expr) ||
       dynamic_cast<const SyncExprAST *>(expr) ||
       dynamic_cast<const AsyncExprAST *>(expr) ||
+      dynamic_cast<const AwaitExprAST *>(expr) ||
       dynamic_cast<const ParForExprAST *>(expr)) {
     return false;
   }
@@ -217,10 +218,11 @@ std::unique_ptr<ExprAST> optimizeExpr(std::unique_ptr<ExprAST> expr) {
     std::unique_ptr<ExprAST> endExpr = optimizeExpr(parForExpr->takeEndExpr());
     std::unique_ptr<ExprAST> stepExpr =
         optimizeExpr(parForExpr->takeStepExpr());
+    std::string reduceOp = parForExpr->getReduceOp();
     std::unique_ptr<ExprAST> body = optimizeExpr(parForExpr->takeBody());
     return std::make_unique<ParForExprAST>(
         varName, std::move(startExpr), std::move(endExpr), std::move(stepExpr),
-        std::move(body), loc);
+        reduceOp, std::move(body), loc);
   }
 
   if (auto *callExpr = dynamic_cast<CallExprAST *>(expr.get())) {
@@ -240,7 +242,19 @@ std::unique_ptr<ExprAST> optimizeExpr(std::unique_ptr<ExprAST> expr) {
     for (auto &arg : args) {
       arg = optimizeExpr(std::move(arg));
     }
-    return std::make_unique<AsyncExprAST>(callee, std::move(args), loc);
+    auto after = asyncExpr->takeAfter();
+    for (auto &handle : after) {
+      handle = optimizeExpr(std::move(handle));
+    }
+    return std::make_unique<AsyncExprAST>(callee, std::move(args),
+                                          std::move(after),
+                                          asyncExpr->getPriority(), loc);
+  }
+
+  if (auto *awaitExpr = dynamic_cast<AwaitExprAST *>(expr.get())) {
+    SourceLocation loc = awaitExpr->getLoc();
+    std::unique_ptr<ExprAST> operand = optimizeExpr(awaitExpr->takeOperand());
+    return std::make_unique<AwaitExprAST>(std::move(operand), loc);
   }
 
   return expr;
@@ -32,6 +32,7 @@ std::unique_ptr<ExprAST> parseExpression();
 std::unique_ptr<ExprAST> parseVarExpr();
 std::unique_ptr<ExprAST> parseSyncExpr();
 std::unique_ptr<ExprAST> parseAsyncExpr();
+std::unique_ptr<ExprAST> parseAwaitExpr();
 std::unique_ptr<ExprAST> parseParForExpr();
 
 // numberexpr ::= number
@@ -189,8 +190,9 @@ std::unique_ptr<ExprAST> parseForExpr() {
                                       std::move(body), forLoc);
 }
 
-// parforexpr ::= 'parfor' identifier '=' expr ',' expr (',' expr)? 'in'
-//                expression
+// parforexpr ::= 'parfor' identifier '=' expr ',' expr (',' expr)?
+//                ('reduce' reduceop)? 'in' expression
+// reduceop   ::= '+' | '*' | 'min' | 'max' | user-defined binary operator
 std::unique_ptr<ExprAST> parseParForExpr() {
   SourceLocation parForLoc = curLoc;
   getNextToken(); // eat parfor
@@ -231,6 +233,26 @@ std::unique_ptr<ExprAST> parseParForExpr() {
     }
   }
 
+  // 'reduce' is only special here, so it stays usable as an identifier.
+  std::string reduceOp;
+  if (curTok == tok_identifier && identifierStr == "reduce") {
+    getNextToken(); // eat reduce
+    if (curTok == tok_identifier &&
+        (identifierStr == "min" || identifierStr == "max")) {
+      reduceOp = identifierStr;
+    } else if (curTok == '+' || curTok == '*' ||
+               (isascii(curTok) && curTok != '<' && curTok != '-' &&
+                binopPrecedence[curTok] > 0)) {
+      // '<' and '-' are not associative, so they cannot be split across
+      // chunks.
+      reduceOp = std::string(1, static_cast<char>(curTok));
+    } else {
+      return logError("expected +, *, min, max, or a user-defined binary "
+                      "operator after reduce");
+    }
+    getNextToken(); // eat operator
+  }
+
   if (curTok != tok_in) {
     return logError("expected 'in' after parfor");
   }
@@ -241,10 +263,9 @@ std::unique_ptr<ExprAST> parseParForExpr() {
     return nullptr;
   }
 
-  return std::make_unique<ParForExprAST>(idName, std::move(startExpr),
-                                         std::move(endExpr),
-                                         std::move(stepExpr), std::move(body),
-                                         parForLoc);
+  return std::make_unique<ParForExprAST>(
+      idName, std::move(startExpr), std::move(endExpr), std::move(stepExpr),
+      reduceOp, std::move(body), parForLoc);
 }
 
 // primary
@@ -274,6 +295,8 @@ std::unique_ptr<ExprAST> parsePrimary() {
     return parseSyncExpr();
   case tok_async:
     return parseAsyncExpr();
+  case tok_await:
+    return parseAwaitExpr();
   default:
     return logError("unknown token when expecting an expression");
   }
@@ -496,6 +519,18 @@ std::unique_ptr<PrototypeAST> parseExtern() {
   return prototype;
 }
 
+// toplevelexpr ::= expression
+// Only the REPL accepts these, wrapped in a function without arguments.
+std::unique_ptr<FunctionAST> parseTopLevelExpr() {
+  SourceLocation exprLoc = curLoc;
+  if (auto expr = parseExpression()) {
+    auto prototype = std::make_unique<PrototypeAST>(
+        "__anon_expr", std::vector<std::string>(), false, 0, exprLoc);
+    return std::make_unique<FunctionAST>(std::move(prototype), std::move(expr));
+  }
+  return nullptr;
+}
+
 std::unique_ptr<ExprAST> parseSyncExpr() {
   SourceLocation syncLoc = curLoc;
   getNextToken(); // eat sync
@@ -513,6 +548,9 @@ std::unique_ptr<ExprAST> parseSyncExpr() {
   return std::make_unique<SyncExprAST>(syncLoc);
 }
 
+// asyncexpr ::= 'async' ('high' | 'low')? identifier
+//               '(' (expression (',' expression)*)? ')'
+//               ('after' (unary | '(' expression (',' expression)* ')'))?
 std::unique_ptr<ExprAST> parseAsyncExpr() {
   SourceLocation asyncLoc = curLoc;
   getNextToken(); // eat async
@@ -524,6 +562,15 @@ std::unique_ptr<ExprAST> parseAsyncExpr() {
   std::string callee = identifierStr;
   getNextToken(); // eat identifier
 
+  // Like 'after', 'high' and 'low' are only special here: followed by '('
+  // they name the callee instead.
+  std::string priority;
+  if ((callee == "high" || callee == "low") && curTok == tok_identifier) {
+    priority = callee;
+    callee = identifierStr;
+    getNextToken(); // eat identifier
+  }
+
   if (curTok != '(') {
     return logError("expected '(' after async callee");
   }
@@ -549,7 +596,54 @@ std::unique_ptr<ExprAST> parseAsyncExpr() {
   }
 
   getNextToken(); // eat ')'
-  return std::make_unique<AsyncExprAST>(callee, std::move(args), asyncLoc);
+
+  // 'after' is only special here, so it stays usable as an identifier. Two
+  // or more handles are parenthesized, since commas already separate call
+  // arguments and var bindings.
+  std::vector<std::unique_ptr<ExprAST>> after;
+  if (curTok == tok_identifier && identifierStr == "after") {
+    getNextToken(); // eat after
+    if (curTok != '(') {
+      auto handle = parseUnary();
+      if (!handle) {
+        return nullptr;
+      }
+      after.push_back(std::move(handle));
+    } else {
+      getNextToken(); // eat '('
+      while (true) {
+        auto handle = parseExpression();
+        if (!handle) {
+          return nullptr;
+        }
+        after.push_back(std::move(handle));
+
+        if (curTok == ')') {
+          break;
+        }
+        if (curTok != ',') {
+          return logError("expected ')' or ',' in async after list");
+        }
+        getNextToken(); // eat ','
+      }
+      getNextToken(); // eat ')'
+    }
+  }
+
+  return std::make_unique<AsyncExprAST>(callee, std::move(args),
+                                        std::move(after), priority, asyncLoc);
+}
+
+// awaitexpr ::= 'await' unary
+std::unique_ptr<ExprAST> parseAwaitExpr() {
+  SourceLocation awaitLoc = curLoc;
+  getNextToken(); // eat await
+
+  auto operand = parseUnary();
+  if (!operand) {
+    return nullptr;
+  }
+  return std::make_unique<AwaitExprAST>(std::move(operand), awaitLoc);
 }
 
 } // namespace Compiler
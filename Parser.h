@@ -12,5 +12,6 @@ std::unique_ptr<ExprAST> parseExpression();
 std::unique_ptr<PrototypeAST> parsePrototype();
 std::unique_ptr<FunctionAST> parseDefinition();
 std::unique_ptr<PrototypeAST> parseExtern();
+std::unique_ptr<FunctionAST> parseTopLevelExpr();
 
 } // namespace Compiler
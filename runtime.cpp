@@ -1,167 +1,3049 @@
+#include "runtime_executor.h"
+#include "runtime_stats.h"
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <condition_variable>
 #include <cstddef>
 #include <cstdio>
-#include <functional>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
-namespace {
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct TaskRecord;
+
+// Sleep slot of one thread, which other threads wake by name, so a finished
+// task wakes only the thread waiting for it. A wakeup that comes before the
+// thread sleeps is kept, and its next park() returns at once; callers check
+// their own condition again either way.
+class Parker {
+  static constexpr std::uint32_t kEmpty = 0;
+  static constexpr std::uint32_t kNotified = 1;
+  static constexpr std::uint32_t kSleeping = 2;
+  std::atomic<std::uint32_t> state{kEmpty};
+#if !defined(__linux__)
+  std::mutex mutex;
+  std::condition_variable wake;
+#endif
+
+public:
+  // Set while the thread is on the runtime's idle list; guarded by the
+  // runtime's idle mutex.
+  bool listed = false;
+
+  void park() {
+    std::uint32_t expected = kNotified;
+    if (state.compare_exchange_strong(expected, kEmpty)) {
+      return;
+    }
+#if defined(__linux__)
+    // Only this thread moves the state away from kNotified.
+    if (state.exchange(kSleeping) == kNotified) {
+      state.store(kEmpty);
+      return;
+    }
+    do {
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&state),
+              FUTEX_WAIT_PRIVATE, kSleeping, nullptr, nullptr, 0);
+      expected = kNotified;
+    } while (!state.compare_exchange_strong(expected, kEmpty));
+#else
+    std::unique_lock<std::mutex> lock(mutex);
+    while (state.load() != kNotified) {
+      wake.wait(lock);
+    }
+    state.store(kEmpty);
+#endif
+  }
+
+  void unpark() {
+#if defined(__linux__)
+    if (state.exchange(kNotified) == kSleeping) {
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&state),
+              FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+#else
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      state.store(kNotified);
+    }
+    wake.notify_one();
+#endif
+  }
+};
+
+// Parkers are recycled instead of freed when their thread exits: a finisher
+// can still be waking a parker while its waiter, having already seen the
+// completion, returns and lets its thread end. A later owner at worst sees
+// one spurious wakeup.
+class ParkerDepot {
+  std::mutex mutex;
+  std::vector<Parker *> freeParkers;
+
+public:
+  Parker *take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (freeParkers.empty()) {
+      return new Parker;
+    }
+    Parker *parker = freeParkers.back();
+    freeParkers.pop_back();
+    return parker;
+  }
+
+  void give(Parker *parker) {
+    std::lock_guard<std::mutex> lock(mutex);
+    parker->listed = false;
+    freeParkers.push_back(parker);
+  }
+};
+
+ParkerDepot &getParkerDepot() {
+  // Leaked for the same reason as the record depots.
+  static auto *depot = new ParkerDepot;
+  return *depot;
+}
+
+struct ThreadParker {
+  Parker *parker = getParkerDepot().take();
+  ~ThreadParker() { getParkerDepot().give(parker); }
+};
+
+thread_local ThreadParker threadParker;
+
+Parker *currentParker() { return threadParker.parker; }
+
+// Completion flag that a waiting thread can park on while it helps.
+struct CompletionSignal {
+  // Set once by the finisher.
+  std::atomic<bool> done{false};
+  // The waiting thread while it is parked, or null.
+  std::atomic<Parker *> waiter{nullptr};
+
+  bool isDone() const { return done.load(); }
+  void setWaiter(Parker *parker) { waiter.store(parker); }
+};
+
+// Async tasks issued by one activation of a compiled function, or by one
+// parfor chunk. Compiled code reserves the group in its own frame, enters it
+// before the first async, and leaves it before returning, which waits for
+// every task issued through it. sync() and await only ever look at the
+// caller's own group, so tasks and host threads never wait on each other's
+// work.
+struct TaskGroup {
+  // Twice the number of unfinished tasks, plus one while the owner is parked
+  // waiting for them. The last finisher learns from its own decrement
+  // whether to wake the owner, and never touches the group afterwards: the
+  // frame holding it can be gone as soon as the count reaches zero.
+  std::atomic<std::size_t> state{0};
+  // Newest handle issued through the group and not yet released. Only the
+  // owning activation touches the list.
+  TaskRecord *issued = nullptr;
+  // Thread of the owning activation, which is the only one that waits on
+  // the group. Finishers read it before their decrement.
+  Parker *owner = currentParker();
+
+  bool isDone() const { return state.load() < 2; }
+  // The owner is the only possible waiter, so parking only sets the bit.
+  void setWaiter(Parker *parker) {
+    if (parker) {
+      state.fetch_or(1);
+    } else {
+      state.fetch_and(~static_cast<std::size_t>(1));
+    }
+  }
+};
+
+// Frame storage compiled code reserves for a group ([4 x i64]).
+constexpr std::size_t kTaskGroupBytes = 32;
+static_assert(sizeof(TaskGroup) <= kTaskGroupBytes &&
+                  alignof(TaskGroup) <= alignof(std::uint64_t),
+              "TaskGroup must fit the frame storage compiled code reserves");
+
+// Queue an async call goes to: `async high` calls go ahead of everything
+// else, `async low` calls only run when nothing else is queued. Compiled code
+// passes it in the CallSite.
+enum class TaskPriority : std::uint8_t { Normal = 0, High = 1, Low = 2 };
+
+// A queued unit of work: a plain function pointer and its argument, so
+// queueing a task never allocates. Async calls pass their task record; parfor
+// helpers pass the shared loop descriptor.
+struct Task {
+  void (*run)(void *) = nullptr;
+  void *data = nullptr;
+  // Group of an async task, which also owns a reference to its task record.
+  // Parfor helpers have neither.
+  TaskGroup *group = nullptr;
+  // Set for a parfor helper queued for one particular worker, which keeps it
+  // away from thieves.
+  bool pinned = false;
+  TaskPriority priority = TaskPriority::Normal;
+  // Enqueue time of a task sampled for the queue-wait histogram, or 0.
+  // Sampled stamps are odd. A full 64 bits, as the low 32 of a nanosecond
+  // clock wrap every 4.3 seconds.
+  std::uint64_t enqueuedAt = 0;
+};
+
+// Per-worker task deque. The owning worker pushes and pops at the back so it
+// keeps working on the most recently spawned (cache-warm) task; idle workers
+// steal from the front, which holds the oldest and usually largest work.
+class WorkQueue {
+  std::mutex mutex;
+  std::deque<Task> tasks;
+
+public:
+  void push(const Task &task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(task);
+  }
+
+  void pushAll(const Task *batch, std::size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.insert(tasks.end(), batch, batch + count);
+  }
+
+  bool pop(Task &task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tasks.empty()) {
+      return false;
+    }
+    task = tasks.back();
+    tasks.pop_back();
+    return true;
+  }
+
+  // Takes the oldest task, passing over pinned ones unless `takePinned`.
+  // Each parfor pins at most one helper per deque, so few are skipped.
+  bool steal(Task &task, bool takePinned) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = tasks.begin();
+    while (found != tasks.end() && found->pinned && !takePinned) {
+      ++found;
+    }
+    if (found == tasks.end()) {
+      return false;
+    }
+    task = *found;
+    tasks.erase(found);
+    return true;
+  }
+};
+
+// Index of the pool worker running on this thread. Threads outside the pool
+// keep kNoWorker and submit round-robin across the worker deques.
+constexpr std::size_t kNoWorker = static_cast<std::size_t>(-1);
+thread_local std::size_t currentWorker = kNoWorker;
+
+// Waits (await or parfor) this thread is currently nested in. Each one that
+// helps adds a task's frames to the stack, so past kMaxHelpDepth a waiter only
+// runs tasks from its own deque, which its own frames spawned.
+constexpr std::size_t kMaxHelpDepth = 16;
+thread_local std::size_t helpDepth = 0;
+
+// Async calls issued inside a `for` loop are held back and published
+// together, one deque lock and at most one wakeup per batch. A thread only
+// holds tasks it issued itself, and every wait it enters publishes them
+// first, since the tasks are already counted in their groups.
+constexpr std::size_t kMaxSubmitBatch = 64;
+constexpr std::size_t kDefaultSubmitBatch = 32;
+struct SubmitBatch {
+  Task tasks[kMaxSubmitBatch];
+  std::size_t count = 0;
+};
+thread_local SubmitBatch submitBatch;
+
+// Dependencies of an `async ... after` call whose predecessors had not all
+// finished when it was issued. Each unfinished predecessor links one edge
+// into its record's dependents list; the predecessor that finishes last
+// queues the task and frees this.
+struct TaskDependencies;
+struct DependencyEdge {
+  TaskDependencies *owner = nullptr;
+  DependencyEdge *next = nullptr;
+};
+struct TaskDependencies {
+  Task task;
+  // Unfinished predecessors, plus one held while the issuer links the edges.
+  std::atomic<std::size_t> remaining{0};
+  std::unique_ptr<DependencyEdge[]> edges;
+};
+
+// Dependents list of a record whose task has finished; nothing links to it
+// any more.
+DependencyEdge finishedDependents;
+
+// State of one async call. Compiled code writes the call's arguments straight
+// into `args`, and the record later holds the callee's result for await. The
+// runtime recycles the record once both the task and its handle are done
+// with it, so steady-state submission never reaches the allocator. Records
+// come in size classes of 1, 2 and 4 cache lines, so the common
+// one-argument call takes a single line; wider calls than the largest class
+// get a record of 8, 16, ... lines from a shared list. No record memory is
+// ever freed, so a stale handle still points at a record.
+constexpr std::size_t kRecordClasses = 3;
+constexpr std::size_t kClassLines[kRecordClasses] = {1, 2, 4};
+constexpr std::size_t kCacheLine = 64;
+constexpr std::uint8_t kOversizedRecord = kRecordClasses;
+constexpr std::size_t kOversizedSizes = 32;
+
+struct TaskRecord {
+  union {
+    // Compiled wrapper, until the task runs.
+    double (*wrapper)(void *);
+    // The callee's return value, once the task has run.
+    double result;
+  };
+  // Next older handle issued through the same group and not yet released.
+  TaskRecord *nextIssued = nullptr;
+  // Group the call was issued through, for a task queued later by its
+  // predecessors or run by a host executor. Atomic only because a stale
+  // handle's check can read it while the record is reissued elsewhere.
+  std::atomic<TaskGroup *> group{nullptr};
+  // Edges of tasks issued `after` this one, or finishedDependents.
+  std::atomic<DependencyEdge *> dependents{nullptr};
+  // Completion of the task, for await.
+  CompletionSignal signal;
+  // One reference for the queued task and one for the handle.
+  std::atomic<std::uint8_t> refs{0};
+  // Set when an await could not release the handle on the spot.
+  std::atomic<bool> awaited{false};
+  // Set when no handle was issued, so nothing waits on `signal`.
+  bool detached = false;
+  // Size class the record was carved for, or kOversizedRecord plus its
+  // power-of-two size.
+  std::uint8_t sizeClass = 0;
+  // Low bits of the handle while the issuer holds it, or 0. Only the issuing
+  // activation sets and clears it.
+  std::atomic<std::uint8_t> tag{0};
+  // Arguments; each record is allocated with room for its class's count.
+  double args[1];
+
+  TaskRecord() : wrapper(nullptr) {}
+};
+
+constexpr std::size_t recordBytes(std::size_t argCount) {
+  return offsetof(TaskRecord, args) + argCount * sizeof(double);
+}
+
+// Arguments that fit in each class after the header.
+constexpr std::size_t classArgs(std::size_t sizeClass) {
+  return (kClassLines[sizeClass] * kCacheLine - offsetof(TaskRecord, args)) /
+         sizeof(double);
+}
+constexpr std::size_t kClassArgs[kRecordClasses] = {classArgs(0), classArgs(1),
+                                                    classArgs(2)};
+
+// Arguments that fit in an oversized record of twice the largest class's
+// lines, shifted left by `size`.
+constexpr std::size_t oversizedArgs(std::size_t size) {
+  return ((kClassLines[kRecordClasses - 1] * kCacheLine << (size + 1)) -
+          offsetof(TaskRecord, args)) /
+         sizeof(double);
+}
+
+// Slabs are line-aligned, so a record that is a whole number of lines never
+// shares one with its neighbours.
+static_assert(classArgs(0) >= 1, "a one-argument call must fit one line");
+static_assert(recordBytes(kClassArgs[0]) == kClassLines[0] * kCacheLine &&
+                  recordBytes(kClassArgs[1]) == kClassLines[1] * kCacheLine &&
+                  recordBytes(kClassArgs[2]) == kClassLines[2] * kCacheLine,
+              "task records must fill whole cache lines");
+
+TaskRecord *recordFromArgs(void *args) {
+  return reinterpret_cast<TaskRecord *>(static_cast<char *>(args) -
+                                        offsetof(TaskRecord, args));
+}
+
+// Records are carved from slabs and exchanged between threads in batches.
+constexpr std::size_t kRecordsPerSlab = 256;
+constexpr std::size_t kRecordBatch = 64;
+
+// Shared pool of free records of one size class. Threads only touch it to
+// refill an empty cache or to hand back a full one, which balances producers
+// that allocate on one thread against workers that release on another.
+class TaskRecordDepot {
+  std::mutex mutex;
+  std::vector<TaskRecord *> freeRecords;
+
+public:
+  // Moves kRecordBatch records of `sizeClass` into `out`.
+  void takeBatch(std::size_t sizeClass, TaskRecord **out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (freeRecords.size() < kRecordBatch) {
+      // Slabs are never returned to the system; the pool only grows to the
+      // peak number of async calls in flight. Records of 1, 2 or 4 lines in
+      // a line-aligned slab never share a cache line.
+      std::size_t bytes = recordBytes(kClassArgs[sizeClass]);
+      auto *slab = static_cast<char *>(::operator new(
+          bytes * kRecordsPerSlab, std::align_val_t{kCacheLine}));
+      for (std::size_t i = 0; i < kRecordsPerSlab; ++i) {
+        auto *record = new (slab + i * bytes) TaskRecord;
+        record->sizeClass = static_cast<std::uint8_t>(sizeClass);
+        freeRecords.push_back(record);
+      }
+    }
+    std::size_t first = freeRecords.size() - kRecordBatch;
+    std::copy(freeRecords.begin() + first, freeRecords.end(), out);
+    freeRecords.resize(first);
+  }
+
+  void giveBatch(TaskRecord *const *records, std::size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    freeRecords.insert(freeRecords.end(), records, records + count);
+  }
+};
+
+TaskRecordDepot &getRecordDepot(std::size_t sizeClass) {
+  // Intentionally leaked so thread exit can return records at any point of
+  // process shutdown.
+  static auto *depots = new TaskRecordDepot[kRecordClasses];
+  return depots[sizeClass];
+}
+
+// Free records for calls wider than the largest class. They are rare, so
+// one locked list per size does without per-thread caches.
+class OversizedRecordDepot {
+  std::mutex mutex;
+  std::vector<TaskRecord *> freeRecords[kOversizedSizes];
+
+public:
+  TaskRecord *allocate(std::size_t argCount) {
+    std::size_t size = 0;
+    while (size + 1 < kOversizedSizes && oversizedArgs(size) < argCount) {
+      ++size;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!freeRecords[size].empty()) {
+        TaskRecord *record = freeRecords[size].back();
+        freeRecords[size].pop_back();
+        return record;
+      }
+    }
+    // Line-aligned like slab records, which leaves the handle its tag bits.
+    void *memory = ::operator new(recordBytes(oversizedArgs(size)),
+                                  std::align_val_t{kCacheLine});
+    auto *record = new (memory) TaskRecord;
+    record->sizeClass = static_cast<std::uint8_t>(kOversizedRecord + size);
+    return record;
+  }
+
+  void release(TaskRecord *record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    freeRecords[record->sizeClass - kOversizedRecord].push_back(record);
+  }
+};
+
+OversizedRecordDepot &getOversizedDepot() {
+  // Leaked like the class depots.
+  static auto *depot = new OversizedRecordDepot;
+  return *depot;
+}
+
+// Per-thread stacks of free records in front of the depots. Allocation and
+// release are an array pop or push on the owning thread.
+class TaskRecordCache {
+  struct Stack {
+    TaskRecord *records[2 * kRecordBatch];
+    std::size_t count = 0;
+  };
+  Stack stacks[kRecordClasses];
+
+public:
+  ~TaskRecordCache() {
+    for (std::size_t c = 0; c < kRecordClasses; ++c) {
+      if (stacks[c].count > 0) {
+        getRecordDepot(c).giveBatch(stacks[c].records, stacks[c].count);
+        stacks[c].count = 0;
+      }
+    }
+  }
+
+  TaskRecord *allocate(std::size_t sizeClass) {
+    Stack &stack = stacks[sizeClass];
+    if (stack.count == 0) {
+      getRecordDepot(sizeClass).takeBatch(sizeClass, stack.records);
+      stack.count = kRecordBatch;
+    }
+    return stack.records[--stack.count];
+  }
+
+  void release(TaskRecord *record) {
+    Stack &stack = stacks[record->sizeClass];
+    if (stack.count == 2 * kRecordBatch) {
+      // Keep one batch and return the other, so a thread that only releases
+      // records (a worker fed by the main thread) does not hoard them.
+      getRecordDepot(record->sizeClass)
+          .giveBatch(stack.records + kRecordBatch, kRecordBatch);
+      stack.count = kRecordBatch;
+    }
+    stack.records[stack.count++] = record;
+  }
+};
+
+thread_local TaskRecordCache recordCache;
+
+TaskRecord *allocateTaskRecord(std::size_t argCount) {
+  TaskRecord *record = nullptr;
+  for (std::size_t c = 0; c < kRecordClasses && !record; ++c) {
+    if (argCount <= kClassArgs[c]) {
+      record = recordCache.allocate(c);
+    }
+  }
+
+  if (!record) {
+    record = getOversizedDepot().allocate(argCount);
+  }
+
+  record->refs.store(2, std::memory_order_relaxed);
+  record->awaited.store(false, std::memory_order_relaxed);
+  record->signal.done.store(false, std::memory_order_relaxed);
+  record->signal.waiter.store(nullptr, std::memory_order_relaxed);
+  record->dependents.store(nullptr, std::memory_order_relaxed);
+  return record;
+}
+
+void releaseTaskRecord(TaskRecord *record) {
+  // The last holder can skip the atomic read-modify-write.
+  if (record->refs.load(std::memory_order_acquire) != 1 &&
+      record->refs.fetch_sub(1) != 1) {
+    return;
+  }
+  if (record->sizeClass >= kOversizedRecord) {
+    getOversizedDepot().release(record);
+    return;
+  }
+  recordCache.release(record);
+}
+
+// An async handle is the record's address carried as an integral double.
+// User-space addresses fit well within the 53 bits a double holds exactly.
+// Records are line-aligned, so the low bits carry the record's tag, which
+// tells a handle still held from one that was given up.
+constexpr std::uintptr_t kTagMask = kCacheLine - 1;
+thread_local std::uint8_t lastHandleTag = 0;
+
+// Tags the record for a new handle. Tags run from 1 to kTagMask, as 0
+// marks a record without one.
+double issueHandle(TaskRecord *record) {
+  lastHandleTag = static_cast<std::uint8_t>(lastHandleTag % kTagMask + 1);
+  record->tag.store(lastHandleTag, std::memory_order_relaxed);
+  return static_cast<double>(reinterpret_cast<std::uintptr_t>(record) |
+                             lastHandleTag);
+}
+
+std::uintptr_t handleBits(double handle) {
+  if (!(handle >= 1.0 && handle < 9007199254740992.0) ||
+      handle != std::floor(handle)) {
+    return 0;
+  }
+  return static_cast<std::uintptr_t>(handle);
+}
+
+TaskRecord *recordFromHandle(double handle) {
+  return reinterpret_cast<TaskRecord *>(handleBits(handle) & ~kTagMask);
+}
+
+// Whether `handle` is one `group` still holds. Only the issuing activation
+// sets the tag and gives the handle up, so for a handle of the caller's own
+// group the answer cannot change under it. Any other handle fails the group
+// or the tag test; its record is never freed, so reading it is safe.
+bool isHeldHandle(const TaskGroup &group, double handle) {
+  std::uintptr_t bits = handleBits(handle);
+  auto *record = reinterpret_cast<TaskRecord *>(bits & ~kTagMask);
+  return record && record->group.load(std::memory_order_relaxed) == &group &&
+         (bits & kTagMask) != 0 &&
+         record->tag.load(std::memory_order_relaxed) == (bits & kTagMask);
+}
+
+// Drops every handle the group still holds. Only called once all of the
+// group's tasks have finished.
+void releaseGroupHandles(TaskGroup &group) {
+  while (TaskRecord *record = group.issued) {
+    group.issued = record->nextIssued;
+    record->tag.store(0, std::memory_order_relaxed);
+    releaseTaskRecord(record);
+  }
+}
+
+// Awaiting the newest handle of the caller's group pops it right away, so
+// fork-join recursion keeps the list short. Any other handle, including one
+// issued by an enclosing activation, is only marked and popped once the
+// handles above it are gone.
+void releaseAwaitedHandle(TaskGroup &group, TaskRecord *record) {
+  record->tag.store(0, std::memory_order_relaxed);
+  if (record != group.issued) {
+    record->awaited.store(true);
+    return;
+  }
+  do {
+    group.issued = record->nextIssued;
+    releaseTaskRecord(record);
+    record = group.issued;
+  } while (record && record->awaited.load());
+}
+
+std::uint64_t nowNanos() {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// One in this many queued tasks is timestamped for the queue-wait histogram,
+// which keeps clock reads off the common submission path.
+constexpr std::uint32_t kQueueWaitSample = 16;
+thread_local std::uint32_t tasksQueued = 0;
+
+// Counters behind RuntimeWorkerStats. A worker's row is only written by that
+// worker, so it updates with relaxed loads and stores; threads outside the
+// pool share one row and add atomically. Readers get a relaxed snapshot.
+struct alignas(64) StatsRow {
+  std::atomic<std::uint64_t> tasks{0};
+  std::atomic<std::uint64_t> chunks{0};
+  std::atomic<std::uint64_t> idleNanos{0};
+  std::atomic<std::uint64_t> syncWaits{0};
+  std::atomic<std::uint64_t> syncWaitNanos{0};
+  std::atomic<std::uint64_t> queueWait[kRuntimeQueueWaitBuckets] = {};
+  // Lifetime of the slot's finished threads, and the start time of the
+  // running one (0 when none runs). Workers only.
+  std::atomic<std::uint64_t> aliveNanos{0};
+  std::atomic<std::uint64_t> startedAt{0};
+};
+
+void addStat(std::atomic<std::uint64_t> &counter, std::uint64_t amount) {
+  if (currentWorker == kNoWorker) {
+    counter.fetch_add(amount, std::memory_order_relaxed);
+  } else {
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+  }
+}
+
+void recordQueueWait(StatsRow &row, std::uint64_t enqueuedAt) {
+  // The clock is steady across threads, but a task that starts within the
+  // nanosecond its odd stamp was rounded up in reads as not having waited.
+  std::uint64_t now = nowNanos();
+  std::uint64_t waited = now > enqueuedAt ? now - enqueuedAt : 0;
+  std::size_t bucket = 0;
+  while (waited > 1 && bucket + 1 < kRuntimeQueueWaitBuckets) {
+    waited >>= 1;
+    ++bucket;
+  }
+  addStat(row.queueWait[bucket], 1);
+}
+
+RuntimeWorkerStats snapshotStats(const StatsRow &row, bool worker,
+                                 std::uint64_t now) {
+  auto read = [](const std::atomic<std::uint64_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  RuntimeWorkerStats stats{};
+  stats.tasks = read(row.tasks);
+  stats.chunks = read(row.chunks);
+  stats.idleNanos = read(row.idleNanos);
+  stats.syncWaits = read(row.syncWaits);
+  stats.syncWaitNanos = read(row.syncWaitNanos);
+  for (std::size_t b = 0; b < kRuntimeQueueWaitBuckets; ++b) {
+    stats.queueWait[b] = read(row.queueWait[b]);
+  }
+  if (worker) {
+    std::uint64_t alive = read(row.aliveNanos);
+    if (std::uint64_t started = read(row.startedAt)) {
+      alive += now > started ? now - started : 0;
+    }
+    stats.busyNanos = alive > stats.idleNanos ? alive - stats.idleNanos : 0;
+  }
+  return stats;
+}
+
+// Describes the source of an async, parfor, sync, or function-exit join:
+// the symbol that runs the work (the wrapper, or the function that waits),
+// the source file, and the line. Compiled code passes a pointer to a
+// constant one with each of those calls; see createCallSite in
+// AbstractSyntaxTree.cpp.
+struct CallSite {
+  const char *symbol;
+  const char *file;
+  std::uint64_t line;
+  // For a parfor, the compiler's estimate of the instructions one iteration
+  // of the body runs, or 0 when it cannot tell.
+  std::uint64_t iterationCost;
+  // For an async call, its TaskPriority.
+  std::uint64_t priority;
+};
+
+enum class TraceKind : std::uint8_t { Task, Chunk, ParFor, Sync, Join };
+
+struct TraceEvent {
+  // The call site, or for a task the wrapper it ran, which is mapped back to
+  // its call site when the trace is written.
+  const void *key = nullptr;
+  std::uint64_t start = 0;
+  std::uint64_t end = 0;
+  // Iteration range of a chunk.
+  std::uint64_t first = 0;
+  std::uint64_t last = 0;
+  TraceKind kind = TraceKind::Task;
+};
+
+// Newest events of one thread. Only that thread writes it; the tracer reads
+// it at exit, after the pool has been joined.
+struct TraceBuffer {
+  std::vector<TraceEvent> events;
+  std::uint64_t recorded = 0;
+  // Chrome trace thread id: the worker slot, or 1000 and up outside the pool.
+  std::size_t threadId = 0;
+};
+
+// Events per thread before the oldest are overwritten.
+constexpr std::size_t kTraceEventsPerThread = 1 << 16;
+
+thread_local TraceBuffer *traceBuffer = nullptr;
+
+// Opt-in timeline of tasks, parfor chunks and calls, and waits, written at
+// exit as Chrome trace JSON (chrome://tracing or ui.perfetto.dev). Enabled
+// by COMPILER_TRACE=<path>.
+class Tracer {
+  std::string path;
+  std::uint64_t origin = 0;
+  std::mutex mutex;
+  // Buffers of every thread that recorded anything; they outlive the thread.
+  std::vector<std::unique_ptr<TraceBuffer>> buffers;
+  std::size_t outsideThreads = 0;
+  // Async wrappers are generated per call site, so each maps to one site.
+  std::unordered_map<const void *, const CallSite *> wrapperSites;
+
+  TraceBuffer &threadBuffer() {
+    if (!traceBuffer) {
+      auto buffer = std::make_unique<TraceBuffer>();
+      buffer->events.resize(kTraceEventsPerThread);
+      std::lock_guard<std::mutex> lock(mutex);
+      buffer->threadId = currentWorker != kNoWorker ? currentWorker
+                                                    : 1000 + outsideThreads++;
+      traceBuffer = buffer.get();
+      buffers.push_back(std::move(buffer));
+    }
+    return *traceBuffer;
+  }
+
+  static void writeString(FILE *out, const char *text) {
+    std::fputc('"', out);
+    for (const char *c = text ? text : ""; *c; ++c) {
+      if (*c == '"' || *c == '\\') {
+        std::fprintf(out, "\\%c", *c);
+      } else if (static_cast<unsigned char>(*c) < 0x20) {
+        std::fprintf(out, "\\u%04x", static_cast<unsigned char>(*c));
+      } else {
+        std::fputc(*c, out);
+      }
+    }
+    std::fputc('"', out);
+  }
+
+  void writeEvent(FILE *out, const TraceBuffer &buffer,
+                  const TraceEvent &event) {
+    static const char *categories[] = {"task", "chunk", "parfor", "sync",
+                                       "join"};
+    const CallSite *site = static_cast<const CallSite *>(event.key);
+    if (event.kind == TraceKind::Task) {
+      auto found = wrapperSites.find(event.key);
+      site = found != wrapperSites.end() ? found->second : nullptr;
+    }
+    const char *category = categories[static_cast<int>(event.kind)];
+    std::fprintf(out, ",\n{\"name\":");
+    if (event.kind == TraceKind::Sync || event.kind == TraceKind::Join) {
+      writeString(out, category);
+    } else {
+      writeString(out, site ? site->symbol : "async task");
+    }
+    std::fprintf(out,
+                 ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                 category, buffer.threadId,
+                 static_cast<double>(event.start - origin) / 1e3,
+                 static_cast<double>(event.end - event.start) / 1e3);
+    if (site) {
+      std::fprintf(out, "\"symbol\":");
+      writeString(out, site->symbol);
+      std::fprintf(out, ",\"file\":");
+      writeString(out, site->file);
+      std::fprintf(out, ",\"line\":%llu",
+                   static_cast<unsigned long long>(site->line));
+    }
+    if (event.kind == TraceKind::Chunk) {
+      std::fprintf(out, "%s\"first\":%llu,\"last\":%llu", site ? "," : "",
+                   static_cast<unsigned long long>(event.first),
+                   static_cast<unsigned long long>(event.last));
+    }
+    std::fprintf(out, "}}");
+  }
+
+public:
+  bool enabled = false;
+
+  Tracer() {
+    if (const char *env = std::getenv("COMPILER_TRACE")) {
+      if (*env) {
+        path = env;
+        enabled = true;
+        origin = nowNanos();
+      }
+    }
+  }
+
+  void record(TraceKind kind, const void *key, std::uint64_t start,
+              std::uint64_t first = 0, std::uint64_t last = 0) {
+    TraceBuffer &buffer = threadBuffer();
+    buffer.events[buffer.recorded++ % kTraceEventsPerThread] = {
+        key, start, nowNanos(), first, last, kind};
+  }
+
+  void noteWrapperSite(const void *wrapper, const CallSite *site) {
+    // Submitting from one call site in a loop is the common case.
+    thread_local const void *lastWrapper = nullptr;
+    if (wrapper == lastWrapper || !site) {
+      return;
+    }
+    lastWrapper = wrapper;
+    std::lock_guard<std::mutex> lock(mutex);
+    wrapperSites.emplace(wrapper, site);
+  }
+
+  // Writes every buffer; called at exit once no thread records any more.
+  void write() {
+    FILE *out = std::fopen(path.c_str(), "w");
+    if (!out) {
+      std::fprintf(stderr, "Warning: could not write trace to %s\n",
+                   path.c_str());
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    std::fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    std::fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"args\":{\"name\":\"compiler runtime\"}}");
+    for (const auto &buffer : buffers) {
+      std::string name =
+          buffer->threadId < 1000
+              ? "worker " + std::to_string(buffer->threadId)
+              : "thread " + std::to_string(buffer->threadId - 1000);
+      std::fprintf(out,
+                   ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                   "\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                   buffer->threadId, name.c_str());
+      std::uint64_t count =
+          std::min<std::uint64_t>(buffer->recorded, kTraceEventsPerThread);
+      if (buffer->recorded > count) {
+        std::fprintf(stderr,
+                     "Warning: trace kept the last %llu of %llu events of %s\n",
+                     static_cast<unsigned long long>(count),
+                     static_cast<unsigned long long>(buffer->recorded),
+                     name.c_str());
+      }
+      for (std::uint64_t i = buffer->recorded - count; i < buffer->recorded;
+           ++i) {
+        writeEvent(out, *buffer, buffer->events[i % kTraceEventsPerThread]);
+      }
+    }
+    std::fprintf(out, "\n]}\n");
+    std::fclose(out);
+  }
+};
+
+// Reads a non-negative integer setting from the environment, or returns
+// `fallback` when it is unset or invalid.
+std::size_t readCountEnv(const char *name, std::size_t fallback) {
+  const char *env = std::getenv(name);
+  if (!env) {
+    return fallback;
+  }
+  char *end = nullptr;
+  long value = std::strtol(env, &end, 10);
+  if (end != env && *end == '\0' && value >= 0) {
+    return static_cast<std::size_t>(value);
+  }
+  std::fprintf(stderr, "Warning: ignoring invalid %s=%s\n", name, env);
+  return fallback;
+}
+
+// Reads a positive integer setting from the environment, or returns 0 when
+// it is unset or invalid.
+std::size_t readPositiveEnv(const char *name) {
+  const char *env = std::getenv(name);
+  if (!env) {
+    return 0;
+  }
+  char *end = nullptr;
+  long requested = std::strtol(env, &end, 10);
+  if (end != env && *end == '\0' && requested > 0) {
+    return static_cast<std::size_t>(requested);
+  }
+  std::fprintf(stderr, "Warning: ignoring invalid %s=%s\n", name, env);
+  return 0;
+}
+
+// Most workers the pool can grow to. Deques are only created for workers
+// that have actually been started.
+constexpr std::size_t kMaxWorkers = 1024;
+
+// Worker count set through __compiler_set_num_workers, or 0.
+std::atomic<std::size_t> requestedWorkerCount{0};
+
+// Executor set through __compiler_set_executor; no callbacks means the
+// built-in pool. Fixed once the runtime has started.
+std::mutex executorMutex;
+CompilerExecutor installedExecutor{};
+bool runtimeStarted = false;
+
+#if defined(__linux__)
+// CPUs in the process's affinity mask (as restricted by taskset or a cpuset),
+// or 0 when it cannot be read.
+std::size_t affinityCpuCount() {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+    return 0;
+  }
+  return static_cast<std::size_t>(CPU_COUNT(&cpus));
+}
+
+// Whole CPUs granted by a CFS quota, rounded up, or 0 for no quota.
+std::size_t quotaCpuCount(double quota, double period) {
+  if (!(quota > 0.0) || !(period > 0.0)) {
+    return 0;
+  }
+  return std::max<std::size_t>(
+      1, static_cast<std::size_t>(std::ceil(quota / period)));
+}
+
+// cgroup v2 keeps "<quota|max> <period>" in cpu.max.
+std::size_t cgroupV2CpuLimit(const std::string &dir) {
+  FILE *file = std::fopen((dir + "/cpu.max").c_str(), "r");
+  if (!file) {
+    return 0;
+  }
+  char quota[32] = {};
+  double period = 0.0;
+  int fields = std::fscanf(file, "%31s %lf", quota, &period);
+  std::fclose(file);
+  if (fields != 2 || std::strcmp(quota, "max") == 0) {
+    return 0;
+  }
+  return quotaCpuCount(std::strtod(quota, nullptr), period);
+}
+
+// cgroup v1 splits the quota (-1 for none) and the period in two files.
+std::size_t cgroupV1CpuLimit(const std::string &dir) {
+  double values[2] = {0.0, 0.0};
+  const char *names[2] = {"/cpu.cfs_quota_us", "/cpu.cfs_period_us"};
+  for (int i = 0; i < 2; ++i) {
+    FILE *file = std::fopen((dir + names[i]).c_str(), "r");
+    if (!file) {
+      return 0;
+    }
+    int fields = std::fscanf(file, "%lf", &values[i]);
+    std::fclose(file);
+    if (fields != 1) {
+      return 0;
+    }
+  }
+  return quotaCpuCount(values[0], values[1]);
+}
+
+// Tightest CPU quota on the cgroup `path` or any of its ancestors below the
+// controller mount `root`. Inside a container the path is often not visible
+// under the mount, and then only the mount root itself is found.
+std::size_t cgroupPathCpuLimit(const std::string &root, std::string path,
+                               bool unified) {
+  std::size_t limit = 0;
+  while (true) {
+    std::size_t cpus =
+        unified ? cgroupV2CpuLimit(root + path) : cgroupV1CpuLimit(root + path);
+    if (cpus > 0 && (limit == 0 || cpus < limit)) {
+      limit = cpus;
+    }
+    if (path.empty() || path == "/") {
+      return limit;
+    }
+    path.erase(path.find_last_of('/'));
+  }
+}
+
+// CPU limit from the cgroup v1 or v2 CPU controller, or 0 when unlimited.
+std::size_t cgroupCpuLimit() {
+  FILE *file = std::fopen("/proc/self/cgroup", "r");
+  if (!file) {
+    return 0;
+  }
+
+  std::size_t limit = 0;
+  char line[4096];
+  while (std::fgets(line, sizeof(line), file)) {
+    // Each line is "hierarchy-id:controllers:path".
+    std::string entry(line);
+    std::size_t first = entry.find(':');
+    std::size_t second = entry.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    std::string controllers = entry.substr(first + 1, second - first - 1);
+    std::string path = entry.substr(second + 1);
+    path.erase(path.find_last_not_of("\r\n") + 1);
+
+    std::size_t cpus = 0;
+    if (controllers.empty()) {
+      cpus = cgroupPathCpuLimit("/sys/fs/cgroup", path, true);
+    } else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+      const char *roots[] = {"/sys/fs/cgroup/cpu",
+                             "/sys/fs/cgroup/cpu,cpuacct"};
+      for (const char *root : roots) {
+        if (std::size_t found = cgroupPathCpuLimit(root, path, false)) {
+          cpus = found;
+          break;
+        }
+      }
+    }
+    if (cpus > 0 && (limit == 0 || cpus < limit)) {
+      limit = cpus;
+    }
+  }
+  std::fclose(file);
+  return limit;
+}
+#endif
+
+// CPUs this process can actually use, or 0 when the platform gives no
+// limit. Containers usually see every host core through
+// hardware_concurrency() while their affinity mask or CPU quota allows far
+// fewer, and a pool sized to the host would oversubscribe them.
+std::size_t availableCpuCount() {
+  std::size_t cpus = 0;
+#if defined(__linux__)
+  std::size_t limits[] = {affinityCpuCount(), cgroupCpuLimit()};
+  for (std::size_t limit : limits) {
+    if (limit > 0 && (cpus == 0 || limit < cpus)) {
+      cpus = limit;
+    }
+  }
+#endif
+  return cpus;
+}
+
+// `listedCpus` is the length of an explicit COMPILER_PLACEMENT list, or 0.
+std::size_t defaultWorkerCount(std::size_t listedCpus) {
+  // A count set by the program before first use wins.
+  if (std::size_t requested = requestedWorkerCount.load()) {
+    return requested;
+  }
+
+  // Explicit override, mainly for benchmarking scaling behavior.
+  if (std::size_t requested = readPositiveEnv("COMPILER_NUM_WORKERS")) {
+    return std::min(requested, kMaxWorkers);
+  }
+
+  // One worker per CPU the placement names.
+  if (listedCpus > 0) {
+    return std::min(listedCpus, kMaxWorkers);
+  }
+
+  std::size_t workerCount = availableCpuCount();
+  if (workerCount == 0) {
+    workerCount = std::thread::hardware_concurrency();
+  }
+  if (workerCount == 0) {
+    // Fallback when the platform gives no hint.
+    workerCount = 2;
+  }
+  return std::min(workerCount, kMaxWorkers);
+}
+
+// Where pool workers run. Workers float across the CPUs the scheduler gives
+// them unless COMPILER_PLACEMENT asks for pinning, which only pays off when
+// the pool has the CPUs to itself.
+struct WorkerPlacement {
+  // CPU of worker i is cpus[i % cpus.size()]; empty when workers float.
+  std::vector<int> cpus;
+  // Memory (NUMA) node of each entry of `cpus`.
+  std::vector<int> nodes;
+  // Distinct nodes the workers are spread over.
+  std::size_t nodeCount = 1;
+  // Set when COMPILER_PLACEMENT listed the CPUs explicitly.
+  bool listed = false;
+
+  int nodeOf(std::size_t worker) const {
+    return cpus.empty() ? 0 : nodes[worker % nodes.size()];
+  }
+};
+
+#if defined(__linux__)
+// Parses a Linux CPU list such as "0-3,8,10-11", as used by sysfs and taskset.
+bool parseCpuList(const char *text, std::vector<int> &cpus) {
+  const char *cursor = text;
+  while (*cursor && *cursor != '\n') {
+    char *after = nullptr;
+    long first = std::strtol(cursor, &after, 10);
+    if (after == cursor || first < 0) {
+      return false;
+    }
+    long last = first;
+    cursor = after;
+    if (*cursor == '-') {
+      ++cursor;
+      last = std::strtol(cursor, &after, 10);
+      if (after == cursor || last < first) {
+        return false;
+      }
+      cursor = after;
+    }
+    if (last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+    if (*cursor == ',') {
+      ++cursor;
+    } else if (*cursor && *cursor != '\n') {
+      return false;
+    }
+  }
+  return !cpus.empty();
+}
+
+// Memory node of every CPU according to sysfs. Without NUMA information every
+// CPU is on node 0.
+std::vector<int> cpuNodes() {
+  std::vector<int> nodes(CPU_SETSIZE, 0);
+  const std::string root = "/sys/devices/system/node/";
+  DIR *dir = opendir(root.c_str());
+  if (!dir) {
+    return nodes;
+  }
+  while (dirent *entry = readdir(dir)) {
+    int node = 0;
+    char extra = 0;
+    if (std::sscanf(entry->d_name, "node%d%c", &node, &extra) != 1) {
+      continue;
+    }
+    FILE *file = std::fopen((root + entry->d_name + "/cpulist").c_str(), "r");
+    if (!file) {
+      continue;
+    }
+    char line[4096];
+    std::vector<int> cpus;
+    if (std::fgets(line, sizeof(line), file) && parseCpuList(line, cpus)) {
+      for (int cpu : cpus) {
+        nodes[cpu] = node;
+      }
+    }
+    std::fclose(file);
+  }
+  closedir(dir);
+  return nodes;
+}
+
+void pinCurrentThread(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    std::fprintf(stderr, "Warning: could not pin a worker to CPU %d\n", cpu);
+  }
+}
+#else
+void pinCurrentThread(int) {}
+#endif
+
+// Reads COMPILER_PLACEMENT: "compact" fills one memory node's CPUs before
+// moving on to the next, "scatter" deals workers round-robin across the
+// nodes, and a CPU list such as "0-3,8" pins worker i to its i-th entry.
+// Only CPUs in the process's affinity mask are used.
+WorkerPlacement defaultPlacement() {
+  WorkerPlacement placement;
+  const char *env = std::getenv("COMPILER_PLACEMENT");
+  if (!env || std::strcmp(env, "none") == 0) {
+    return placement;
+  }
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    std::fprintf(stderr, "Warning: ignoring COMPILER_PLACEMENT=%s: could not "
+                         "read the affinity mask\n",
+                 env);
+    return placement;
+  }
+  std::vector<int> nodeOfCpu = cpuNodes();
+
+  bool compact = std::strcmp(env, "compact") == 0;
+  bool scatter = std::strcmp(env, "scatter") == 0;
+  std::vector<int> cpus;
+  if (compact || scatter) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+    std::stable_sort(cpus.begin(), cpus.end(), [&](int a, int b) {
+      return nodeOfCpu[a] < nodeOfCpu[b];
+    });
+    if (scatter) {
+      // Split the node-ordered list into one run per node and take one CPU
+      // from each run in turn.
+      std::vector<std::vector<int>> runs;
+      for (std::size_t i = 0; i < cpus.size(); ++i) {
+        if (i == 0 || nodeOfCpu[cpus[i]] != nodeOfCpu[cpus[i - 1]]) {
+          runs.emplace_back();
+        }
+        runs.back().push_back(cpus[i]);
+      }
+      std::size_t total = cpus.size();
+      cpus.clear();
+      for (std::size_t round = 0; cpus.size() < total; ++round) {
+        for (const std::vector<int> &run : runs) {
+          if (round < run.size()) {
+            cpus.push_back(run[round]);
+          }
+        }
+      }
+    }
+  } else {
+    std::vector<int> listed;
+    if (!parseCpuList(env, listed)) {
+      std::fprintf(stderr, "Warning: ignoring invalid COMPILER_PLACEMENT=%s\n",
+                   env);
+      return placement;
+    }
+    for (int cpu : listed) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      } else {
+        std::fprintf(stderr,
+                     "Warning: COMPILER_PLACEMENT CPU %d is outside the "
+                     "affinity mask\n",
+                     cpu);
+      }
+    }
+    placement.listed = true;
+  }
+
+  std::vector<int> seenNodes;
+  for (int cpu : cpus) {
+    placement.nodes.push_back(nodeOfCpu[cpu]);
+    if (std::find(seenNodes.begin(), seenNodes.end(), nodeOfCpu[cpu]) ==
+        seenNodes.end()) {
+      seenNodes.push_back(nodeOfCpu[cpu]);
+    }
+  }
+  placement.cpus = cpus;
+  placement.nodeCount = std::max<std::size_t>(1, seenNodes.size());
+#else
+  std::fprintf(stderr,
+               "Warning: ignoring COMPILER_PLACEMENT=%s: pinning is only "
+               "supported on Linux\n",
+               env);
+#endif
+  return placement;
+}
+
+// How parallelFor sizes the ranges that participants claim.
+enum class LoopSchedule {
+  // Equal chunks, about four per worker (the original scheduler).
+  Static,
+  // Chunks shrink with the remaining iteration count, down to a minimum grain.
+  Guided,
+  // One block of iterations per worker, fixed by the iteration count and the
+  // pool size, so a loop repeated over the same range gives each worker the
+  // same iterations as last time. Idle workers steal from the back of other
+  // blocks.
+  Affinity,
+};
+
+// Pinned workers default to the affinity schedule, which is what keeps their
+// caches and memory nodes warm across calls.
+LoopSchedule defaultLoopSchedule(bool pinned) {
+  LoopSchedule fallback = pinned ? LoopSchedule::Affinity : LoopSchedule::Guided;
+  const char *env = std::getenv("COMPILER_PARFOR_SCHEDULE");
+  if (!env) {
+    return fallback;
+  }
+  if (std::strcmp(env, "guided") == 0) {
+    return LoopSchedule::Guided;
+  }
+  if (std::strcmp(env, "static") == 0) {
+    return LoopSchedule::Static;
+  }
+  if (std::strcmp(env, "affinity") == 0) {
+    return LoopSchedule::Affinity;
+  }
+  std::fprintf(stderr,
+               "Warning: ignoring invalid COMPILER_PARFOR_SCHEDULE=%s\n", env);
+  return fallback;
+}
+
+// How a parfor reduction groups the floating-point operations that combine
+// its body values.
+enum class ReduceOrder {
+  // Each participant folds the ranges it claims and the caller folds the
+  // participants' results, so the grouping depends on scheduling.
+  Fast,
+  // Fixed leaves that depend only on the iteration count, combined in a fixed
+  // pairwise tree, so the result is the same on every run and pool size.
+  Deterministic,
+};
+
+ReduceOrder defaultReduceOrder() {
+  const char *env = std::getenv("COMPILER_PARFOR_REDUCE");
+  if (!env || std::strcmp(env, "fast") == 0) {
+    return ReduceOrder::Fast;
+  }
+  if (std::strcmp(env, "deterministic") == 0) {
+    return ReduceOrder::Deterministic;
+  }
+  std::fprintf(stderr, "Warning: ignoring invalid COMPILER_PARFOR_REDUCE=%s\n",
+               env);
+  return ReduceOrder::Fast;
+}
+
+// How long an idle thread looks for work before it parks, when neither
+// COMPILER_SPIN_US nor a single usable CPU says otherwise.
+constexpr std::uint64_t kDefaultSpinNanos = 50000;
+// Spinning threads stop pausing and start yielding the CPU once this share
+// of their budget is gone, so an oversubscribed pool still lets the
+// submitter run.
+constexpr std::uint64_t kSpinPauseShare = 4;
+
+// Spin budget in nanoseconds. On one CPU a spinning worker only delays the
+// thread that would give it work, so the default there is not to spin.
+std::uint64_t defaultSpinNanos() {
+  std::size_t cpus = availableCpuCount();
+  if (cpus == 0) {
+    cpus = std::thread::hardware_concurrency();
+  }
+  std::uint64_t fallback = cpus == 1 ? 0 : kDefaultSpinNanos / 1000;
+  return readCountEnv("COMPILER_SPIN_US", fallback) * 1000;
+}
+
+// x86-64 microarchitecture level of this CPU, as the psABI defines them:
+// 1 for baseline x86-64, 2 up to SSE4.2, 3 for AVX2 and FMA, 4 for the
+// AVX-512 subset. 0 on other architectures. The AVX checks include the OS
+// saving the wider registers.
+unsigned detectCpuLevel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+  bool cx16 = false, movbe = false, f16c = false;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    cx16 = ecx & bit_CMPXCHG16B;
+    movbe = ecx & bit_MOVBE;
+    f16c = ecx & bit_F16C;
+  }
+  bool lahf = false, lzcnt = false;
+  if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+    lahf = ecx & bit_LAHF_LM;
+    lzcnt = ecx & bit_ABM;
+  }
+  bool v2 = cx16 && lahf && __builtin_cpu_supports("popcnt") &&
+            __builtin_cpu_supports("sse3") &&
+            __builtin_cpu_supports("ssse3") &&
+            __builtin_cpu_supports("sse4.1") &&
+            __builtin_cpu_supports("sse4.2");
+  bool v3 = v2 && movbe && f16c && lzcnt && __builtin_cpu_supports("avx") &&
+            __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") &&
+            __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma");
+  bool v4 = v3 && __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512cd") &&
+            __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("avx512vl");
+  return v4 ? 4 : v3 ? 3 : v2 ? 2 : 1;
+#else
+  return 0;
+#endif
+}
+
+// Tells the CPU we are in a spin-wait loop, which saves power and frees the
+// core for a sibling hyperthread.
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// This thread's current spin budget. It drops by half each time a spin ends
+// in parking anyway, down to a sixteenth of the full budget, and is restored
+// by the first spin that finds work, so a thread that is only woken by
+// sparse submissions stops burning its CPU on them.
+thread_local std::uint64_t spinNanos = ~std::uint64_t{0};
+
+// Upper bound on the leaves of a deterministic reduction.
+constexpr std::size_t kReduceLeaves = 256;
+
+// Iterations of a deterministic reduction's leaves. Depends only on the
+// iteration count, so neither does the combine tree.
+std::size_t reduceLeafSize(std::size_t iterations) {
+  std::size_t leafCount = std::min(iterations, kReduceLeaves);
+  return (iterations + leafCount - 1) / leafCount;
+}
+
+// A parfor runs on the calling thread alone when it has a single iteration,
+// or when the compiler's cost estimate puts the whole loop below
+// kDefaultInlineWork instructions. Handing a loop to the pool and waiting
+// for it costs a few microseconds, which is thousands of instructions.
+constexpr std::size_t kDefaultInlineWork = 4096;
+
+// Whether parallelFor tunes each loop's grain size and participant count.
+enum class TuneMode {
+  // Learn the settings of every loop as it runs. Opt-in until the search
+  // has been measured on more multi-core hosts.
+  On,
+  // Use the settings loaded from the tuning file and learn nothing, so runs
+  // are reproducible.
+  Frozen,
+  // Use COMPILER_PARFOR_MIN_GRAIN and the whole pool for every loop
+  // (default).
+  Off,
+};
+
+TuneMode defaultTuneMode() {
+  const char *env = std::getenv("COMPILER_PARFOR_TUNE");
+  if (!env || std::strcmp(env, "off") == 0) {
+    return TuneMode::Off;
+  }
+  if (std::strcmp(env, "on") == 0) {
+    return TuneMode::On;
+  }
+  if (std::strcmp(env, "freeze") == 0) {
+    return TuneMode::Frozen;
+  }
+  std::fprintf(stderr, "Warning: ignoring invalid COMPILER_PARFOR_TUNE=%s\n",
+               env);
+  return TuneMode::Off;
+}
+
+// Calls of a loop timed for each candidate setting.
+constexpr std::uint64_t kTuneSamples = 8;
+// A candidate is only kept when it is this much faster than the best so far,
+// so timing noise does not walk the search.
+constexpr double kTuneMargin = 0.03;
+// Time per iteration is only compared between calls whose iteration counts
+// are within this factor of each other.
+constexpr std::uint64_t kTuneScaleFactor = 2;
+
+// Settings for one parallelFor call.
+struct LoopPlan {
+  std::size_t grain = 1;
+  // Most participants the loop may have; 0 leaves it to the pool size.
+  std::size_t workers = 0;
+  // The candidate this call measures, or 0 when it is not timed.
+  std::uint64_t epoch = 0;
+};
+
+// Tuning state of one parfor, keyed by its wrapper. The search first
+// doubles the grain for as long as the time per iteration improves, then
+// halves the participants the same way, and settles on the best pair.
+struct LoopTuning {
+  // "line symbol file" of the call site, which names the loop in the tuning
+  // file; empty without a call site.
+  std::string key;
+  std::atomic<bool> settled{false};
+  // Chosen settings, written once before `settled` is set.
+  std::size_t grain = 1;
+  std::size_t workers = 0;
+
+  // Search state.
+  std::mutex mutex;
+  // Grain the search starts from.
+  std::size_t firstGrain = 1;
+  // Iteration count of the call that started the search, and the timed
+  // calls since the last one near it.
+  std::uint64_t scale = 0;
+  std::uint64_t strays = 0;
+  bool tuningWorkers = false;
+  LoopPlan candidate;
+  LoopPlan best;
+  double bestCost = 0.0;
+  std::uint64_t samples = 0;
+  std::uint64_t nanos = 0;
+  std::uint64_t iterations = 0;
+};
+
+// Learns per-loop settings across calls. With COMPILER_PARFOR_TUNE_FILE set,
+// settings are loaded from that file at startup and, unless tuning is
+// frozen, written back at exit.
+class LoopTuner {
+  std::string path;
+  std::mutex mutex;
+  std::unordered_map<const void *, std::unique_ptr<LoopTuning>> loops;
+  // Settings from the file, by key; loops not run this time keep theirs.
+  std::unordered_map<std::string, std::pair<std::size_t, std::size_t>> loaded;
+
+  void load() {
+    FILE *in = std::fopen(path.c_str(), "r");
+    if (!in) {
+      return;
+    }
+    char line[4096];
+    while (std::fgets(line, sizeof(line), in)) {
+      unsigned long long grain = 0;
+      unsigned long long workers = 0;
+      int keyStart = 0;
+      if (std::sscanf(line, "%llu %llu %n", &grain, &workers, &keyStart) < 2 ||
+          grain == 0 || keyStart == 0) {
+        continue;
+      }
+      std::string key = line + keyStart;
+      while (!key.empty() && (key.back() == '\n' || key.back() == '\r')) {
+        key.pop_back();
+      }
+      loaded[key] = {static_cast<std::size_t>(grain),
+                     static_cast<std::size_t>(workers)};
+    }
+    std::fclose(in);
+  }
+
+  // Starts the search over for calls of about `iterations` iterations.
+  static void restart(LoopTuning &tuning, std::uint64_t iterations) {
+    tuning.scale = iterations;
+    tuning.strays = 0;
+    tuning.tuningWorkers = false;
+    tuning.candidate.grain = tuning.firstGrain;
+    tuning.candidate.workers = 0;
+    ++tuning.candidate.epoch;
+    tuning.best = LoopPlan{};
+    tuning.bestCost = 0.0;
+    tuning.samples = 0;
+    tuning.nanos = 0;
+    tuning.iterations = 0;
+  }
+
+  static void settle(LoopTuning &tuning) {
+    tuning.grain = tuning.best.grain;
+    tuning.workers = tuning.best.workers;
+    tuning.settled.store(true, std::memory_order_release);
+  }
+
+public:
+  TuneMode mode = TuneMode::Off;
+
+  LoopTuner() {
+    mode = defaultTuneMode();
+    if (const char *env = std::getenv("COMPILER_PARFOR_TUNE_FILE")) {
+      path = env;
+    }
+    if (mode != TuneMode::Off && !path.empty()) {
+      load();
+    }
+  }
+
+  LoopTuning &find(const void *wrapper, const CallSite *site,
+                   std::size_t minGrain) {
+    // A thread usually runs the same loop many times in a row.
+    thread_local const void *lastWrapper = nullptr;
+    thread_local LoopTuning *lastTuning = nullptr;
+    if (wrapper == lastWrapper) {
+      return *lastTuning;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<LoopTuning> &slot = loops[wrapper];
+    if (!slot) {
+      slot = std::make_unique<LoopTuning>();
+      if (site) {
+        slot->key = std::to_string(site->line) + " " +
+                    (site->symbol ? site->symbol : "") + " " +
+                    (site->file ? site->file : "");
+      }
+      slot->firstGrain = minGrain;
+      slot->candidate.grain = minGrain;
+      slot->candidate.epoch = 1;
+      auto found = loaded.find(slot->key);
+      if (!slot->key.empty() && found != loaded.end()) {
+        slot->best.grain = found->second.first;
+        slot->best.workers = found->second.second;
+        settle(*slot);
+      } else if (mode == TuneMode::Frozen) {
+        slot->best.grain = minGrain;
+        settle(*slot);
+      }
+    }
+    lastWrapper = wrapper;
+    lastTuning = slot.get();
+    return *slot;
+  }
+
+  LoopPlan plan(LoopTuning &tuning) {
+    if (tuning.settled.load(std::memory_order_acquire)) {
+      return {tuning.grain, tuning.workers, 0};
+    }
+    std::lock_guard<std::mutex> lock(tuning.mutex);
+    return tuning.candidate;
+  }
+
+  // Adds a timed call to its candidate and, once the candidate has enough
+  // calls, moves the search on. A call timed under an older candidate is
+  // dropped, and so is one of a very different size from the calls the
+  // search started with, as fixed costs per call skew the time per
+  // iteration. When a whole window of calls has a different size, the loop
+  // now runs at that size and the search starts over.
+  void report(LoopTuning &tuning, const LoopPlan &plan, std::uint64_t nanos,
+              std::size_t iterations, std::size_t poolSize) {
+    std::lock_guard<std::mutex> lock(tuning.mutex);
+    if (plan.epoch != tuning.candidate.epoch ||
+        tuning.settled.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if (tuning.scale == 0) {
+      tuning.scale = iterations;
+    }
+    if (iterations * kTuneScaleFactor < tuning.scale ||
+        iterations > tuning.scale * kTuneScaleFactor) {
+      if (++tuning.strays == kTuneSamples) {
+        restart(tuning, iterations);
+      }
+      return;
+    }
+    tuning.strays = 0;
+    tuning.nanos += nanos;
+    tuning.iterations += iterations;
+    if (++tuning.samples < kTuneSamples) {
+      return;
+    }
+    double cost = static_cast<double>(tuning.nanos) /
+                  static_cast<double>(tuning.iterations);
+    std::uint64_t meanIterations = tuning.iterations / tuning.samples;
+    tuning.samples = 0;
+    tuning.nanos = 0;
+    tuning.iterations = 0;
+    ++tuning.candidate.epoch;
+
+    bool better =
+        tuning.bestCost == 0.0 || cost < tuning.bestCost * (1.0 - kTuneMargin);
+    if (better) {
+      tuning.best = tuning.candidate;
+      tuning.bestCost = cost;
+    }
+    if (!tuning.tuningWorkers) {
+      // A grain covering the whole loop leaves nothing to share.
+      if (better && tuning.candidate.grain * 2 < meanIterations) {
+        tuning.candidate.grain *= 2;
+        return;
+      }
+      tuning.tuningWorkers = true;
+      tuning.candidate.grain = tuning.best.grain;
+      tuning.candidate.workers = poolSize / 2;
+      if (tuning.candidate.workers > 0) {
+        return;
+      }
+    } else if (better && tuning.candidate.workers > 1) {
+      tuning.candidate.workers /= 2;
+      return;
+    }
+    settle(tuning);
+  }
+
+  // Writes the settled loops, and the loaded ones this run did not see.
+  void write() {
+    if (mode != TuneMode::On || path.empty()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : loops) {
+      const LoopTuning &tuning = *entry.second;
+      if (!tuning.key.empty() && tuning.settled.load()) {
+        loaded[tuning.key] = {tuning.grain, tuning.workers};
+      }
+    }
+    FILE *out = std::fopen(path.c_str(), "w");
+    if (!out) {
+      std::fprintf(stderr, "Warning: could not write parfor tuning to %s\n",
+                   path.c_str());
+      return;
+    }
+    for (const auto &entry : loaded) {
+      std::fprintf(out, "%zu %zu %s\n", entry.second.first, entry.second.second,
+                   entry.first.c_str());
+    }
+    std::fclose(out);
+  }
+};
+
+// Partial result of a parfor reduction. Each slot has a single writer.
+struct PartialResult {
+  double value = 0.0;
+  bool present = false;
+};
+
+// Completion tracking for one parallelFor call.
+struct CompletionGroup {
+  // Units of work (loop iterations) not yet finished.
+  std::atomic<std::size_t> pending{0};
+  // Raised by the last finisher.
+  CompletionSignal signal;
+};
+
+// One worker's block of an affinity-scheduled loop. `bounds` packs the first
+// (low half) and one past the last (high half) unclaimed iteration, relative
+// to `begin`: the owner claims from the front and other participants from
+// the back, so they only meet on the block's last range.
+struct alignas(64) LoopBlock {
+  std::size_t begin = 0;
+  std::atomic<std::uint64_t> bounds{0};
+};
+
+class AsyncRuntime;
+AsyncRuntime &getRuntime();
+
+// Shared descriptor of one parallelFor call. The calling thread and the
+// helper tasks it publishes all claim contiguous iteration ranges from `next`
+// until the iteration space is exhausted; `group.pending` counts iterations
+// that have not finished yet. The descriptor is reference counted because a
+// helper can still be queued after the loop has completed and the caller has
+// returned.
+struct ParallelLoop {
+  AsyncRuntime *runtime = nullptr;
+  void (*task)(void *, std::size_t, std::size_t) = nullptr;
+  // Set instead of `task` for a reduction: folds the body values of one
+  // non-empty range, and `combine` folds two partial results.
+  double (*reduce)(void *, std::size_t, std::size_t) = nullptr;
+  double (*combine)(double, double) = nullptr;
+  void *data = nullptr;
+  std::size_t iterations = 0;
+  // Caller plus helpers; guided chunks are sized relative to it.
+  std::size_t participants = 0;
+  // Smallest range a participant claims.
+  std::size_t grain = 1;
+  // Fixed chunk size for the static schedule.
+  std::size_t staticChunk = 0;
+  // First unclaimed iteration.
+  std::atomic<std::size_t> next{0};
+  // Per-worker blocks under the affinity schedule, used instead of `next`.
+  std::unique_ptr<LoopBlock[]> blocks;
+  std::size_t blockCount = 0;
+  CompletionGroup group;
+  // The caller plus every helper task that has not run yet.
+  std::atomic<std::size_t> refs{1};
+  // Reduction results: one slot per participant, or one per leaf when
+  // `leafSize` is set for the deterministic order.
+  std::vector<PartialResult> partials;
+  std::size_t leafSize = 0;
+  // Next participant slot for a reduction helper; the caller owns slot 0.
+  std::atomic<std::size_t> nextParticipant{1};
+  // Source of the loop, for tracing.
+  const CallSite *site = nullptr;
+};
+
+// Process-wide work-stealing pool used by async/sync.
+class AsyncRuntime {
+  // One deque per worker slot, created when the slot is first started. A
+  // deque outlives a retired worker, so tasks left in it can still be stolen.
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  // Deques created so far; thieves scan all of them.
+  std::atomic<std::size_t> queueCount{0};
+  // Workers the pool should be running. Workers at or above this index
+  // retire once they are idle.
+  std::atomic<std::size_t> activeWorkers{0};
+  // Serializes resizes with retiring workers.
+  std::mutex resizeMutex;
+  // Pool threads, one per slot; a retired slot keeps its thread until it is
+  // joined by a later resize or by shutdown.
+  std::vector<std::thread> workers;
+  // Set by a worker as it retires; guarded by resizeMutex.
+  std::vector<bool> workerRetired;
+  // Stealable tasks sitting in any deque; lets idle workers decide whether
+  // to sleep.
+  std::atomic<std::size_t> queuedTasks{0};
+  // Pinned tasks sitting in each worker's deque.
+  std::unique_ptr<std::atomic<std::size_t>[]> pinnedTasks;
+  // Shared FIFO queues for high and low priority async calls; their tasks
+  // also count in queuedTasks.
+  WorkQueue highQueue;
+  WorkQueue lowQueue;
+  // Tasks sitting in highQueue, which parfor participants check between
+  // ranges.
+  std::atomic<std::size_t> highTasks{0};
+  // Round-robin cursor for submissions from outside the pool.
+  std::atomic<std::size_t> nextQueue{0};
+  // Counters per worker slot, created with its deque, and for every thread
+  // outside the pool.
+  std::vector<std::unique_ptr<StatsRow>> stats;
+  StatsRow externalStats;
+  // Set by COMPILER_RUNTIME_STATS to print the counters at exit.
+  bool reportStats = false;
+  Tracer tracer;
+  LoopTuner tuner;
+
+  // Guards the idle list.
+  std::mutex idleMutex;
+  // Parked threads that take new work: idle workers and helping waiters. A
+  // submitter removes the one it wakes, so the next submission wakes another.
+  std::vector<Parker *> idleParkers;
+  // Size of the idle list, readable without the mutex.
+  std::atomic<std::size_t> sleepingWorkers{0};
+  // Set during teardown.
+  std::atomic<bool> shuttingDown{false};
+
+  // CPUs the workers are pinned to, if any.
+  WorkerPlacement placement;
+  // Chunk sizing policy for parallelFor.
+  LoopSchedule loopSchedule = LoopSchedule::Guided;
+  // Smallest range a parallelFor participant claims, before tuning.
+  std::size_t minGrain = 1;
+  // Combination order for parfor reductions.
+  ReduceOrder reduceOrder = ReduceOrder::Fast;
+  // Async calls from a `for` loop published together; 1 publishes each one.
+  std::size_t submitBatchSize = kDefaultSubmitBatch;
+  // Sequential cutoff for parallelFor; see kDefaultInlineWork.
+  std::size_t inlineWork = kDefaultInlineWork;
+  // Longest an idle thread spins before parking; 0 disables spinning.
+  std::uint64_t spinBudget = 0;
+  // Host executor that replaces the pool, or no callbacks.
+  CompilerExecutor host{};
+
+  bool hosted() const { return host.submit != nullptr; }
+
+  StatsRow &statsRow() {
+    return currentWorker == kNoWorker ? externalStats : *stats[currentWorker];
+  }
+
+  static Task sampled(const Task &task) {
+    Task stamped = task;
+    if (++tasksQueued % kQueueWaitSample == 0) {
+      stamped.enqueuedAt = nowNanos() | 1;
+    }
+    return stamped;
+  }
+
+  // Deque that work submitted from this thread goes to.
+  std::size_t submitQueue() {
+    std::size_t index = currentWorker;
+    if (index == kNoWorker) {
+      index = nextQueue.fetch_add(1, std::memory_order_relaxed) %
+              activeWorkers.load(std::memory_order_relaxed);
+    }
+    return index;
+  }
+
+  void push(const Task &task) {
+    // Count the task before publishing it so thieves never see the counter
+    // lag behind the deques. Paired with the list-then-check in park(),
+    // either we see the sleeper or the sleeper sees this task.
+    queuedTasks.fetch_add(1);
+    if (task.priority == TaskPriority::High) {
+      highTasks.fetch_add(1);
+      highQueue.push(sampled(task));
+    } else if (task.priority == TaskPriority::Low) {
+      lowQueue.push(sampled(task));
+    } else {
+      queues[submitQueue()]->push(sampled(task));
+    }
+    if (sleepingWorkers.load() > 0) {
+      wakeWorker();
+    }
+  }
+
+  // Holds an async task in this thread's batch, publishing the batch once
+  // it is full.
+  void pushBatched(const Task &task) {
+    SubmitBatch &batch = submitBatch;
+    batch.tasks[batch.count++] = sampled(task);
+    if (batch.count >= submitBatchSize) {
+      publishBatch();
+    }
+  }
+
+  // Publishes the tasks this thread has batched. Only one worker is woken;
+  // it passes the wakeup on while it finds more queued work.
+  void publishBatch() {
+    SubmitBatch &batch = submitBatch;
+    if (batch.count == 0) {
+      return;
+    }
+    std::size_t index = submitQueue();
+    // Counted first for the same reason as in push().
+    queuedTasks.fetch_add(batch.count);
+    queues[index]->pushAll(batch.tasks, batch.count);
+    batch.count = 0;
+    if (sleepingWorkers.load() > 0) {
+      wakeWorker();
+    }
+  }
+
+  // Queues a parfor helper that only worker `index` runs, unless it retires
+  // first. The caller wakes the pool once it has queued all of them.
+  void pushPinned(std::size_t index, const Task &task) {
+    // Counted first for the same reason as in push().
+    pinnedTasks[index].fetch_add(1);
+    queues[index]->push(sampled(task));
+  }
+
+  void countTaken(std::size_t index, const Task &task) {
+    if (task.pinned) {
+      pinnedTasks[index].fetch_sub(1);
+    } else {
+      queuedTasks.fetch_sub(1);
+    }
+  }
+
+  bool hasQueuedWork() const {
+    std::size_t self = currentWorker;
+    return queuedTasks.load() > 0 ||
+           (self != kNoWorker && pinnedTasks[self].load() > 0);
+  }
+
+  bool popOwnTask(Task &task) {
+    std::size_t self = currentWorker;
+    if (self != kNoWorker && queues[self]->pop(task)) {
+      countTaken(self, task);
+      return true;
+    }
+    return false;
+  }
+
+  bool stealFrom(std::size_t victim, Task &task) {
+    // A retired worker's pinned tasks are fair game, and so is every pinned
+    // task once shutdown starts, since its worker may already have left.
+    if (queues[victim]->steal(task, victim >= activeWorkers.load() ||
+                                        shuttingDown.load())) {
+      countTaken(victim, task);
+      return true;
+    }
+    return false;
+  }
+
+  bool takeHighTask(Task &task) {
+    if (highTasks.load(std::memory_order_relaxed) == 0 ||
+        !highQueue.steal(task, true)) {
+      return false;
+    }
+    highTasks.fetch_sub(1);
+    queuedTasks.fetch_sub(1);
+    return true;
+  }
+
+  bool takeLowTask(Task &task) {
+    if (!lowQueue.steal(task, true)) {
+      return false;
+    }
+    queuedTasks.fetch_sub(1);
+    return true;
+  }
+
+  bool findTask(Task &task) {
+    std::size_t self = currentWorker;
+    if (takeHighTask(task) || popOwnTask(task)) {
+      return true;
+    }
+
+    // Steal from the other workers, starting just past our own deque so
+    // thieves spread out instead of all hitting worker 0. When the workers
+    // are pinned across several memory nodes, peers on our own node go
+    // first, since the data their tasks touch is more likely to be local.
+    std::size_t count = queueCount.load();
+    std::size_t start = self == kNoWorker ? 0 : self + 1;
+    bool byNode = placement.nodeCount > 1 && self != kNoWorker;
+    int node = byNode ? placement.nodeOf(self) : 0;
+    for (int pass = byNode ? 0 : 1; pass < 2; ++pass) {
+      for (std::size_t i = 0; i < count; ++i) {
+        std::size_t victim = (start + i) % count;
+        if (victim == self ||
+            (byNode && (placement.nodeOf(victim) == node) != (pass == 0))) {
+          continue;
+        }
+        if (stealFrom(victim, task)) {
+          return true;
+        }
+      }
+    }
+    return takeLowTask(task);
+  }
+
+  void wakeWorker() {
+    Parker *parker = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(idleMutex);
+      if (idleParkers.empty()) {
+        return;
+      }
+      // The most recently parked thread has the warmest cache.
+      parker = idleParkers.back();
+      idleParkers.pop_back();
+      parker->listed = false;
+      sleepingWorkers.fetch_sub(1);
+    }
+    parker->unpark();
+  }
+
+  // Wakes every parked worker, for work that not just any worker can take.
+  void wakeAllWorkers() {
+    std::lock_guard<std::mutex> lock(idleMutex);
+    for (Parker *parker : idleParkers) {
+      parker->listed = false;
+      parker->unpark();
+    }
+    idleParkers.clear();
+    sleepingWorkers.store(0);
+  }
+
+  // Puts the calling thread on the idle list, or takes it off, unless it is
+  // already there or a waker already took it off. Returns whether it did.
+  bool listIdle(Parker &parker, bool idle) {
+    std::lock_guard<std::mutex> lock(idleMutex);
+    if (parker.listed == idle) {
+      return false;
+    }
+    if (idle) {
+      idleParkers.push_back(&parker);
+      sleepingWorkers.fetch_add(1);
+    } else {
+      idleParkers.erase(
+          std::find(idleParkers.begin(), idleParkers.end(), &parker));
+      sleepingWorkers.fetch_sub(1);
+    }
+    parker.listed = idle;
+    return true;
+  }
+
+  template <typename Waitable> bool shouldWake(Waitable *target) const {
+    return shuttingDown.load() || hasQueuedWork() ||
+           (target ? target->isDone() : isRetiring());
+  }
+
+  // Polls for the conditions park() waits on, for up to this thread's spin
+  // budget. A spinning thread is not counted as sleeping, so submitters skip
+  // the futex wake and a completing task skips waking its waiter.
+  template <typename Waitable> bool spinUntilWoken(Waitable *target) {
+    std::uint64_t budget = std::min(spinNanos, spinBudget);
+    if (budget == 0) {
+      return false;
+    }
+    std::uint64_t start = nowNanos();
+    std::uint64_t elapsed = 0;
+    while (elapsed < budget) {
+      if (shouldWake(target)) {
+        spinNanos = spinBudget;
+        return true;
+      }
+      if (elapsed < budget / kSpinPauseShare) {
+        for (int i = 0; i < 32; ++i) {
+          cpuRelax();
+        }
+      } else {
+        std::this_thread::yield();
+      }
+      elapsed = nowNanos() - start;
+    }
+    spinNanos = std::max(budget / 2, spinBudget / 16);
+    return false;
+  }
+
+  // Parks until work is queued or shutdown starts. A thread helping while it
+  // waits for a parallelFor, an await, or a task group passes what it waits
+  // on, so it also wakes when that completes. It spins for a while first,
+  // since work that arrives soon is cheaper to catch awake.
+  template <typename Waitable = CompletionSignal>
+  void park(Waitable *target = nullptr) {
+    std::uint64_t parkedAt = nowNanos();
+    if (spinUntilWoken(target)) {
+      addStat(statsRow().idleNanos, nowNanos() - parkedAt);
+      return;
+    }
+    Parker &self = *currentParker();
+    if (target) {
+      target->setWaiter(&self);
+    }
+    // Wait for work, completion, shutdown, or (for an idle worker) a resize
+    // that retires it. Listing ourselves before the check pairs with
+    // submitters counting a task before they look for sleepers: either we
+    // see the task or they see us. A waker takes us off the list, so we
+    // list ourselves again if its task was gone by the time we woke.
+    while (true) {
+      listIdle(self, true);
+      if (shouldWake(target)) {
+        break;
+      }
+      self.park();
+    }
+    bool claimed = !listIdle(self, false);
+    if (target) {
+      target->setWaiter(nullptr);
+      // A submitter may have spent its wakeup on us just as our own wait
+      // ended; hand it to a peer.
+      if (claimed && queuedTasks.load() > 0 && sleepingWorkers.load() > 0) {
+        wakeWorker();
+      }
+    }
+    addStat(statsRow().idleNanos, nowNanos() - parkedAt);
+  }
 
-// Process-wide worker pool used by async/sync.
-class AsyncRuntime {
-  // Shared state.
-  std::mutex mutex;
-  // Signals workers when tasks are queued.
-  std::condition_variable workAvailable;
-  // Signals sync() when all work is done.
-  std::condition_variable workFinished;
-  // Pending work items.
-  std::queue<std::function<void()>> tasks;
-  // Pool threads.
-  std::vector<std::thread> workers;
-  // Number of unfinished tasks.
-  std::size_t pendingTasks = 0;
-  // Set during teardown.
-  bool shuttingDown = false;
+  void raiseSignal(CompletionSignal &signal) {
+    // The waiter publishes itself before checking done and we store done
+    // before looking for it, so at least one of us sees the other. Nobody
+    // waiting costs nothing beyond the store.
+    signal.done.store(true);
+    if (Parker *waiter = signal.waiter.load()) {
+      waiter->unpark();
+    }
+  }
+
+  // Queues a task on the pool, or hands it to the host executor.
+  void schedule(const Task &task) {
+    if (hosted()) {
+      host.submit(host.context, &AsyncRuntime::runHostTask, task.data);
+    } else {
+      push(task);
+    }
+  }
+
+  // Called once the task behind `record` has finished: queues every
+  // dependent it was the last unfinished predecessor of.
+  void releaseDependents(TaskRecord &record) {
+    DependencyEdge *edge = record.dependents.exchange(
+        &finishedDependents, std::memory_order_acq_rel);
+    while (edge) {
+      // The edge can be freed as soon as its owner is released.
+      DependencyEdge *next = edge->next;
+      TaskDependencies *dependencies = edge->owner;
+      if (dependencies->remaining.fetch_sub(1, std::memory_order_acq_rel) ==
+          1) {
+        schedule(dependencies->task);
+        delete dependencies;
+      }
+      edge = next;
+    }
+  }
+
+  // Links `task` behind the tasks of the `after` handles that have not
+  // finished. Returns false when none is left, and the caller queues it.
+  bool deferUntilFinished(const Task &task, const double *after,
+                          std::size_t count) {
+    auto *dependencies = new TaskDependencies;
+    dependencies->task = task;
+    dependencies->edges.reset(new DependencyEdge[count]);
+    dependencies->remaining.store(count + 1, std::memory_order_relaxed);
+    std::size_t unlinked = 1;
+    for (std::size_t i = 0; i < count; ++i) {
+      TaskRecord *predecessor = recordFromHandle(after[i]);
+      if (!predecessor) {
+        std::fprintf(stderr, "Error: async after an invalid task handle\n");
+        ++unlinked;
+        continue;
+      }
+      // The dependent's own handle is not issued yet, so it fails too.
+      if (!isHeldHandle(*task.group, after[i])) {
+        std::fprintf(stderr, "Error: async after a handle already awaited or "
+                             "from another activation\n");
+        ++unlinked;
+        continue;
+      }
+      DependencyEdge *edge = &dependencies->edges[i];
+      edge->owner = dependencies;
+      DependencyEdge *head =
+          predecessor->dependents.load(std::memory_order_acquire);
+      bool linked = false;
+      while (head != &finishedDependents && !linked) {
+        edge->next = head;
+        linked = predecessor->dependents.compare_exchange_weak(
+            head, edge, std::memory_order_release, std::memory_order_acquire);
+      }
+      if (!linked) {
+        ++unlinked;
+      }
+    }
+    if (dependencies->remaining.fetch_sub(unlinked,
+                                          std::memory_order_acq_rel) ==
+        unlinked) {
+      delete dependencies;
+      return false;
+    }
+    return true;
+  }
+
+  void finishGroupTask(TaskGroup &group) {
+    // Read before the decrement: the group can be gone right after it.
+    Parker *owner = group.owner;
+    // One task left and the owner parked: the owner is waiting on us.
+    if (group.state.fetch_sub(2) == 3) {
+      owner->unpark();
+    }
+  }
+
+  // Blocks until the target completes without counting as an idle worker, so
+  // submitters never spend a wakeup on a thread that will not take work.
+  template <typename Waitable> void waitFor(Waitable &target) {
+    std::uint64_t parkedAt = nowNanos();
+    Parker &self = *currentParker();
+    target.setWaiter(&self);
+    while (!target.isDone()) {
+      self.park();
+    }
+    target.setWaiter(nullptr);
+    addStat(statsRow().idleNanos, nowNanos() - parkedAt);
+  }
+
+  void completeWork(CompletionGroup &group, std::size_t amount) {
+    if (group.pending.fetch_sub(amount) == amount) {
+      raiseSignal(group.signal);
+    }
+  }
+
+  // Runs queued tasks on the calling thread until the target completes, so a
+  // nested parfor, an await, or a sync inside a task never parks a pool
+  // thread while there is work it could do. The deque is LIFO for its owner,
+  // so a loop's own chunks or an awaited child are usually picked up first.
+  template <typename Waitable> void helpUntilDone(Waitable &target) {
+    // Stealing can pick up an unrelated task that waits in turn; bound how
+    // deep that nests. Whoever owns the awaited work's deque still runs it.
+    bool maySteal = helpDepth < kMaxHelpDepth;
+    ++helpDepth;
+    while (!target.isDone()) {
+      Task task;
+      if (maySteal ? findTask(task) : popOwnTask(task)) {
+        runTask(task);
+        continue;
+      }
+      if (maySteal) {
+        park(&target);
+      } else {
+        waitFor(target);
+      }
+    }
+    --helpDepth;
+  }
+
+  template <typename Waitable> static int isDone(void *target) {
+    return static_cast<Waitable *>(target)->isDone() ? 1 : 0;
+  }
+
+  // Waits for the target in the host executor when there is one, and
+  // otherwise helps the pool until it completes.
+  template <typename Waitable> void waitUntilDone(Waitable &target) {
+    if (!hosted()) {
+      helpUntilDone(target);
+    } else if (!target.isDone()) {
+      host.wait(host.context, &AsyncRuntime::isDone<Waitable>, &target);
+    }
+  }
+
+  std::size_t nextChunkSize(const ParallelLoop &loop,
+                            std::size_t remaining) const {
+    std::size_t size = loop.staticChunk;
+    if (loopSchedule == LoopSchedule::Guided) {
+      // Hand out large ranges while plenty of work remains and shrink them
+      // towards the end, so an expensive late range cannot leave the other
+      // participants idle for long.
+      size = std::max(loop.grain, remaining / (2 * loop.participants));
+    }
+    return std::min(size, remaining);
+  }
 
-  void workerLoop() {
+  // Takes half of what is left of a block, but at least `grain`, from the
+  // front for the block's owner and from the back for anyone else.
+  bool claimFromBlock(LoopBlock &block, bool owner, std::size_t grain,
+                      std::size_t &begin, std::size_t &end) {
+    std::uint64_t bounds = block.bounds.load(std::memory_order_relaxed);
     while (true) {
-      std::function<void()> task;
+      std::uint64_t front = bounds & 0xffffffffu;
+      std::uint64_t back = bounds >> 32;
+      if (front >= back) {
+        return false;
+      }
+      std::uint64_t size = std::min<std::uint64_t>(
+          back - front, std::max<std::uint64_t>(grain, (back - front) / 2));
+      std::uint64_t claimed =
+          owner ? (back << 32) | (front + size) : ((back - size) << 32) | front;
+      if (block.bounds.compare_exchange_weak(bounds, claimed,
+                                             std::memory_order_relaxed)) {
+        begin = block.begin + (owner ? front : back - size);
+        end = begin + size;
+        return true;
+      }
+    }
+  }
 
-      {
-        std::unique_lock<std::mutex> lock(mutex);
-        // Wait for work or shutdown.
-        workAvailable.wait(lock,
-                           [this] { return shuttingDown || !tasks.empty(); });
+  // Affinity schedule: a worker first works through its own block, then
+  // helps with the others. Threads outside the pool own no block.
+  bool claimBlockRange(ParallelLoop &loop, std::size_t &begin,
+                       std::size_t &end) {
+    std::size_t self = currentWorker;
+    std::size_t count = loop.blockCount;
+    if (self < count &&
+        claimFromBlock(loop.blocks[self], true, loop.grain, begin, end)) {
+      return true;
+    }
+    std::size_t start = self < count ? self + 1 : 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      std::size_t victim = (start + i) % count;
+      if (victim != self &&
+          claimFromBlock(loop.blocks[victim], false, loop.grain, begin,
+                         end)) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-        // Exit once shutdown starts and no work remains.
-        if (shuttingDown && tasks.empty()) {
-          return;
-        }
+  // Runs queued high priority calls between the ranges of a parfor, so they
+  // do not wait for the rest of the loop. Nests like helping does.
+  void runHighTasks() {
+    if (highTasks.load(std::memory_order_relaxed) == 0 ||
+        helpDepth >= kMaxHelpDepth) {
+      return;
+    }
+    ++helpDepth;
+    Task task;
+    while (takeHighTask(task)) {
+      runTask(task);
+    }
+    --helpDepth;
+  }
+
+  bool claimRange(ParallelLoop &loop, std::size_t &begin, std::size_t &end) {
+    if (loop.blockCount > 0) {
+      return claimBlockRange(loop, begin, end);
+    }
+    begin = loop.next.load(std::memory_order_relaxed);
+    while (begin < loop.iterations) {
+      std::size_t size = nextChunkSize(loop, loop.iterations - begin);
+      if (loop.next.compare_exchange_weak(begin, begin + size,
+                                          std::memory_order_relaxed)) {
+        end = begin + size;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void runLoopRanges(ParallelLoop &loop) {
+    std::uint64_t chunks = 0;
+    std::size_t begin;
+    std::size_t end;
+    while (claimRange(loop, begin, end)) {
+      ++chunks;
+      std::uint64_t start = tracer.enabled ? nowNanos() : 0;
+      loop.task(loop.data, begin, end);
+      if (tracer.enabled) {
+        tracer.record(TraceKind::Chunk, loop.site, start, begin, end);
+      }
+      completeWork(loop.group, end - begin);
+      runHighTasks();
+    }
+    addStat(statsRow().chunks, chunks);
+  }
+
+  // Folds every range this participant claims into one partial result. The
+  // slot is written before the iterations count as finished, so the caller
+  // only reads it once every participant has published its own.
+  void runReductionRanges(ParallelLoop &loop, std::size_t participant) {
+    PartialResult partial;
+    std::size_t finished = 0;
+    std::uint64_t chunks = 0;
+    std::size_t begin;
+    std::size_t end;
+    while (claimRange(loop, begin, end)) {
+      ++chunks;
+      std::uint64_t start = tracer.enabled ? nowNanos() : 0;
+      double value = loop.reduce(loop.data, begin, end);
+      if (tracer.enabled) {
+        tracer.record(TraceKind::Chunk, loop.site, start, begin, end);
+      }
+      partial.value =
+          partial.present ? loop.combine(partial.value, value) : value;
+      partial.present = true;
+      finished += end - begin;
+      runHighTasks();
+    }
+    addStat(statsRow().chunks, chunks);
+    if (finished > 0) {
+      loop.partials[participant] = partial;
+      completeWork(loop.group, finished);
+    }
+  }
 
-        // Take one task from the queue.
-        task = std::move(tasks.front());
-        tasks.pop();
+  // Deterministic order: claims whole leaves, whose boundaries depend only on
+  // the iteration count, and stores each leaf's result in its own slot.
+  void runReductionLeaves(ParallelLoop &loop) {
+    std::size_t leafCount = loop.partials.size();
+    std::uint64_t chunks = 0;
+    std::size_t leaf;
+    while ((leaf = loop.next.fetch_add(1, std::memory_order_relaxed)) <
+           leafCount) {
+      ++chunks;
+      std::size_t begin = leaf * loop.leafSize;
+      std::size_t end = std::min(begin + loop.leafSize, loop.iterations);
+      std::uint64_t start = tracer.enabled ? nowNanos() : 0;
+      loop.partials[leaf] = {loop.reduce(loop.data, begin, end), true};
+      if (tracer.enabled) {
+        tracer.record(TraceKind::Chunk, loop.site, start, begin, end);
       }
+      completeWork(loop.group, end - begin);
+      runHighTasks();
+    }
+    addStat(statsRow().chunks, chunks);
+  }
 
-      // Run work outside the lock.
-      task();
+  void participate(ParallelLoop &loop, std::size_t participant) {
+    if (!loop.reduce) {
+      runLoopRanges(loop);
+    } else if (loop.leafSize > 0) {
+      runReductionLeaves(loop);
+    } else {
+      runReductionRanges(loop, participant);
+    }
+  }
 
-      {
-        std::lock_guard<std::mutex> lock(mutex);
-        // Wake sync() when the last task finishes.
-        --pendingTasks;
-        if (pendingTasks == 0) {
-          workFinished.notify_all();
+  // Combines the partial results once every participant has finished.
+  static double combinePartials(ParallelLoop &loop) {
+    std::vector<PartialResult> &partials = loop.partials;
+    if (loop.leafSize > 0) {
+      // Pairwise tree over the leaves in index order. Its shape depends only
+      // on the leaf count, so the rounding does too.
+      for (std::size_t stride = 1; stride < partials.size(); stride *= 2) {
+        for (std::size_t i = 0; i + stride < partials.size();
+             i += 2 * stride) {
+          partials[i].value =
+              loop.combine(partials[i].value, partials[i + stride].value);
         }
       }
+      return partials[0].value;
+    }
+
+    // Participants that claimed nothing left their slot empty.
+    PartialResult result;
+    for (const PartialResult &partial : partials) {
+      if (partial.present) {
+        result.value = result.present ? loop.combine(result.value, partial.value)
+                                      : partial.value;
+        result.present = true;
+      }
     }
+    return result.value;
   }
 
-public:
-  AsyncRuntime() {
-    std::size_t workerCount = std::thread::hardware_concurrency();
-    if (workerCount == 0) {
-      // Fallback when the platform gives no hint.
-      workerCount = 2;
+  bool runsInline(std::size_t iterations, const CallSite *site) const {
+    if (iterations == 1) {
+      return true;
     }
+    std::uint64_t cost = site ? site->iterationCost : 0;
+    return cost > 0 && iterations < inlineWork / cost;
+  }
 
-    for (std::size_t i = 0; i < workerCount; ++i) {
-      workers.emplace_back([this] { workerLoop(); });
+  // Runs a whole loop on the calling thread. A deterministic reduction still
+  // folds the same leaves in the same tree as it would on the pool.
+  double runInline(void (*task)(void *, std::size_t, std::size_t),
+                   double (*reduce)(void *, std::size_t, std::size_t),
+                   double (*combine)(double, double), void *data,
+                   std::size_t iterations) {
+    if (!reduce) {
+      task(data, 0, iterations);
+      return 0.0;
+    }
+    if (reduceOrder == ReduceOrder::Fast) {
+      return reduce(data, 0, iterations);
     }
+    ParallelLoop loop;
+    loop.combine = combine;
+    loop.leafSize = reduceLeafSize(iterations);
+    for (std::size_t begin = 0; begin < iterations; begin += loop.leafSize) {
+      std::size_t end = std::min(begin + loop.leafSize, iterations);
+      loop.partials.push_back({reduce(data, begin, end), true});
+    }
+    return combinePartials(loop);
   }
 
-  ~AsyncRuntime() {
-    // Finish work before tearing down the pool.
-    sync();
+  // Body a host executor runs over the leaves of a reduction.
+  static void runHostLeaves(void *descriptor, std::size_t first,
+                            std::size_t last) {
+    auto *loop = static_cast<ParallelLoop *>(descriptor);
+    for (std::size_t leaf = first; leaf < last; ++leaf) {
+      std::size_t begin = leaf * loop->leafSize;
+      std::size_t end = std::min(begin + loop->leafSize, loop->iterations);
+      loop->partials[leaf] = {loop->reduce(loop->data, begin, end), true};
+    }
+  }
 
+  // Hands a whole loop to the host executor. The host picks the ranges, so a
+  // reduction always uses the fixed leaves of the deterministic order.
+  double runHosted(void (*task)(void *, std::size_t, std::size_t),
+                   double (*reduce)(void *, std::size_t, std::size_t),
+                   double (*combine)(double, double), void *data,
+                   std::size_t iterations) {
+    if (!reduce) {
+      host.parallel_for(host.context, iterations, task, data);
+      return 0.0;
+    }
+    ParallelLoop loop;
+    loop.reduce = reduce;
+    loop.combine = combine;
+    loop.data = data;
+    loop.iterations = iterations;
+    loop.leafSize = reduceLeafSize(iterations);
+    loop.partials.resize((iterations + loop.leafSize - 1) / loop.leafSize);
+    host.parallel_for(host.context, loop.partials.size(),
+                      &AsyncRuntime::runHostLeaves, &loop);
+    return combinePartials(loop);
+  }
+
+  static void releaseLoop(ParallelLoop *loop) {
+    if (loop->refs.fetch_sub(1) == 1) {
+      delete loop;
+    }
+  }
+
+  // Task entry point for async calls.
+  static void runAsyncTask(void *data) {
+    auto *record = static_cast<TaskRecord *>(data);
+    double (*wrapper)(void *) = record->wrapper;
+    record->result = wrapper(record->args);
+  }
+
+  // Entry point of an async call run by a host executor.
+  static void runHostTask(void *data) {
+    auto *record = static_cast<TaskRecord *>(data);
+    getRuntime().runTask(
+        Task{&AsyncRuntime::runAsyncTask, record,
+             record->group.load(std::memory_order_relaxed)});
+  }
+
+  // Task entry point for parfor helpers. A helper that starts after the
+  // cursor is exhausted claims nothing and only drops its reference.
+  static void runLoopHelper(void *descriptor) {
+    auto *loop = static_cast<ParallelLoop *>(descriptor);
+    std::size_t participant =
+        loop->reduce && loop->leafSize == 0 ? loop->nextParticipant.fetch_add(1)
+                                            : 0;
+    loop->runtime->participate(*loop, participant);
+    releaseLoop(loop);
+  }
+
+  void runTask(const Task &task) {
+    StatsRow &row = statsRow();
+    addStat(row.tasks, 1);
+    if (task.enqueuedAt != 0) {
+      recordQueueWait(row, task.enqueuedAt);
+    }
+    if (tracer.enabled && task.group) {
+      // The record's result overwrites the wrapper, so read it first.
+      auto *wrapper = reinterpret_cast<const void *>(
+          static_cast<TaskRecord *>(task.data)->wrapper);
+      std::uint64_t start = nowNanos();
+      task.run(task.data);
+      tracer.record(TraceKind::Task, wrapper, start);
+    } else {
+      task.run(task.data);
+    }
+    if (!task.group) {
+      return;
+    }
+
+    auto *record = static_cast<TaskRecord *>(task.data);
+    if (!record->detached) {
+      // Only a handle can name the task as a predecessor.
+      releaseDependents(*record);
+      raiseSignal(record->signal);
+    }
+    releaseTaskRecord(record);
+    finishGroupTask(*task.group);
+  }
+
+  bool isRetiring() const {
+    return currentWorker != kNoWorker && currentWorker >= activeWorkers.load();
+  }
+
+  // Lets the worker exit unless a resize has brought its slot back.
+  bool retire(std::size_t index) {
     {
-      std::lock_guard<std::mutex> lock(mutex);
-      shuttingDown = true;
+      std::lock_guard<std::mutex> lock(resizeMutex);
+      if (index < activeWorkers.load()) {
+        return false;
+      }
+      workerRetired[index] = true;
+    }
+    // A submitter may have spent its wakeup on us; hand it to a peer.
+    if (queuedTasks.load() > 0 && sleepingWorkers.load() > 0) {
+      wakeWorker();
+    }
+    return true;
+  }
+
+  void workerLoop(std::size_t index) {
+    currentWorker = index;
+    if (!placement.cpus.empty()) {
+      pinCurrentThread(placement.cpus[index % placement.cpus.size()]);
+    }
+    StatsRow &row = *stats[index];
+    std::uint64_t started = nowNanos();
+    row.startedAt.store(started, std::memory_order_relaxed);
+    serveTasks(index);
+    row.aliveNanos.store(row.aliveNanos.load(std::memory_order_relaxed) +
+                             (nowNanos() - started),
+                         std::memory_order_relaxed);
+    row.startedAt.store(0, std::memory_order_relaxed);
+  }
+
+  void serveTasks(std::size_t index) {
+    while (true) {
+      if (index >= activeWorkers.load()) {
+        // Run what was queued for this worker before leaving, so a parfor
+        // helper pinned to it is not stranded.
+        Task task;
+        if (popOwnTask(task)) {
+          runTask(task);
+          continue;
+        }
+        if (retire(index)) {
+          return;
+        }
+      }
+
+      Task task;
+      if (findTask(task)) {
+        // Pass the wakeup on while queued work remains, so a burst of
+        // submissions ramps up the whole pool rather than one worker.
+        if (queuedTasks.load() > 0 && sleepingWorkers.load() > 0) {
+          wakeWorker();
+        }
+        // Run work outside any queue lock.
+        runTask(task);
+        continue;
+      }
+
+      // Exit once shutdown starts and no work remains. Peers take pinned
+      // helpers during shutdown, and the runtime runs any pushed after the
+      // last worker left.
+      if (shuttingDown.load() && queuedTasks.load() == 0) {
+        return;
+      }
+      park();
+    }
+  }
+
+public:
+  AsyncRuntime() {
+    {
+      std::lock_guard<std::mutex> lock(executorMutex);
+      host = installedExecutor;
+      runtimeStarted = true;
+    }
+    if (!hosted()) {
+      placement = defaultPlacement();
     }
+    loopSchedule = defaultLoopSchedule(!placement.cpus.empty());
+    if (std::size_t grain = readPositiveEnv("COMPILER_PARFOR_MIN_GRAIN")) {
+      minGrain = grain;
+    }
+    reduceOrder = defaultReduceOrder();
+    spinBudget = defaultSpinNanos();
+    inlineWork = readCountEnv("COMPILER_PARFOR_INLINE_WORK", kDefaultInlineWork);
+    if (std::size_t batch = readPositiveEnv("COMPILER_ASYNC_BATCH")) {
+      submitBatchSize = std::min(batch, kMaxSubmitBatch);
+    }
+    const char *statsEnv = std::getenv("COMPILER_RUNTIME_STATS");
+    reportStats = statsEnv && std::strcmp(statsEnv, "0") != 0;
+    if (hosted()) {
+      // The host's threads run everything, so no worker is started.
+      return;
+    }
+
+    // Slots are allocated up front so that growing the pool never moves a
+    // deque other threads may be reading.
+    queues.resize(kMaxWorkers);
+    stats.resize(kMaxWorkers);
+    workers.resize(kMaxWorkers);
+    workerRetired.assign(kMaxWorkers, false);
+    pinnedTasks.reset(new std::atomic<std::size_t>[kMaxWorkers]());
+    resize(defaultWorkerCount(placement.listed ? placement.cpus.size() : 0));
+  }
+
+  ~AsyncRuntime() {
+    // Every async task belongs to a group that compiled code joins before it
+    // returns, so only parfor helpers that found no work can still be queued.
+    shuttingDown.store(true);
     // Wake idle workers so they can exit.
-    workAvailable.notify_all();
+    wakeAllWorkers();
 
     for (auto &worker : workers) {
       if (worker.joinable()) {
         worker.join();
       }
     }
+    // A parfor helper pinned just as its worker left would otherwise leak
+    // its loop. Its range is almost always claimed by now, so running it
+    // mostly just drops its reference.
+    Task task;
+    for (std::size_t i = 0; i < queueCount.load(); ++i) {
+      while (queues[i]->pop(task)) {
+        countTaken(i, task);
+        runTask(task);
+      }
+    }
+    if (reportStats) {
+      printStats(stderr);
+    }
+    if (tracer.enabled) {
+      tracer.write();
+    }
+    tuner.write();
   }
 
-  void enqueue(std::function<void()> task) {
-    {
-      std::lock_guard<std::mutex> lock(mutex);
-      // Count work as pending when it is queued.
-      ++pendingTasks;
-      tasks.push(std::move(task));
+  // `batched` holds the task back in this thread's batch; the caller
+  // publishes it with publishBatch() or by waiting.
+  // `after` lists the handles of tasks that must finish first; the task is
+  // only queued once they have.
+  double enqueue(TaskGroup &group, double (*wrapper)(void *), void *args,
+                 bool detached, bool batched, const CallSite *site,
+                 const double *after = nullptr, std::size_t afterCount = 0) {
+    if (tracer.enabled) {
+      tracer.noteWrapperSite(reinterpret_cast<const void *>(wrapper), site);
+    }
+    TaskRecord *record = recordFromArgs(args);
+    record->wrapper = wrapper;
+    record->detached = detached;
+    if (detached) {
+      // Nothing can await the call, so only the task holds the record.
+      record->refs.store(1, std::memory_order_relaxed);
+    } else {
+      record->nextIssued = group.issued;
+      group.issued = record;
+    }
+    // Count work as pending when it is queued.
+    group.state.fetch_add(2, std::memory_order_relaxed);
+    record->group.store(&group, std::memory_order_relaxed);
+    // The task may finish, and a detached record be recycled, as soon as it
+    // is queued.
+    double handle = detached ? 0.0 : issueHandle(record);
+    Task task{&AsyncRuntime::runAsyncTask, record, &group};
+    if (site) {
+      task.priority = static_cast<TaskPriority>(site->priority);
     }
-    // Wake one worker.
-    workAvailable.notify_one();
+    if (afterCount > 0 && deferUntilFinished(task, after, afterCount)) {
+      return handle;
+    }
+    if (batched && !hosted() && task.priority == TaskPriority::Normal) {
+      pushBatched(task);
+    } else {
+      schedule(task);
+    }
+    return handle;
   }
 
-  void sync() {
-    std::unique_lock<std::mutex> lock(mutex);
-    // Wait until no tasks remain.
-    workFinished.wait(lock, [this] { return pendingTasks == 0; });
+  void flushBatch() { publishBatch(); }
+
+  double await(TaskGroup &group, double handle) {
+    TaskRecord *record = recordFromHandle(handle);
+    if (!record) {
+      std::fprintf(stderr, "Error: await on an invalid task handle\n");
+      return 0.0;
+    }
+    publishBatch();
+    waitUntilDone(record->signal);
+    double result = record->result;
+    releaseAwaitedHandle(group, record);
+    return result;
+  }
+
+  // `kind` tells an explicit sync() from the join at function exit.
+  void sync(TaskGroup &group, const CallSite *site, TraceKind kind) {
+    publishBatch();
+    if (!group.isDone()) {
+      // A wait nested in another one on this thread is already part of the
+      // outer wait's time, so only the outermost is timed.
+      bool timed = helpDepth == 0;
+      std::uint64_t waitStart = timed || tracer.enabled ? nowNanos() : 0;
+      waitUntilDone(group);
+      StatsRow &row = statsRow();
+      addStat(row.syncWaits, 1);
+      if (timed) {
+        addStat(row.syncWaitNanos, nowNanos() - waitStart);
+      }
+      if (tracer.enabled) {
+        tracer.record(kind, site, waitStart);
+      }
+    }
+    // Every task of the group has finished, so handles not awaited so far
+    // are dropped.
+    releaseGroupHandles(group);
+  }
+
+  std::size_t workerCount() const { return activeWorkers.load(); }
+
+  // Fills up to `capacity` rows: the started worker slots, then the threads
+  // outside the pool. Returns how many rows there are.
+  std::size_t collectStats(RuntimeWorkerStats *rows, std::size_t capacity) {
+    std::size_t slots = queueCount.load();
+    std::uint64_t now = nowNanos();
+    for (std::size_t i = 0; i < slots && i < capacity; ++i) {
+      rows[i] = snapshotStats(*stats[i], true, now);
+    }
+    if (slots < capacity) {
+      rows[slots] = snapshotStats(externalStats, false, now);
+    }
+    return slots + 1;
+  }
+
+  void printStats(FILE *out) {
+    std::vector<RuntimeWorkerStats> rows(collectStats(nullptr, 0));
+    collectStats(rows.data(), rows.size());
+
+    auto millis = [](std::uint64_t nanos) { return nanos / 1e6; };
+    RuntimeWorkerStats total{};
+    std::fprintf(out, "runtime stats: %zu workers\n", workerCount());
+    std::fprintf(out, "%-10s %10s %10s %10s %10s %10s %12s\n", "thread",
+                 "tasks", "chunks", "busy ms", "idle ms", "sync waits",
+                 "sync wait ms");
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+      const RuntimeWorkerStats &row = rows[i];
+      std::string name =
+          i + 1 < rows.size() ? "worker " + std::to_string(i) : "outside";
+      std::fprintf(out, "%-10s %10llu %10llu %10.3f %10.3f %10llu %12.3f\n",
+                   name.c_str(), static_cast<unsigned long long>(row.tasks),
+                   static_cast<unsigned long long>(row.chunks),
+                   millis(row.busyNanos), millis(row.idleNanos),
+                   static_cast<unsigned long long>(row.syncWaits),
+                   millis(row.syncWaitNanos));
+      total.tasks += row.tasks;
+      total.chunks += row.chunks;
+      total.busyNanos += row.busyNanos;
+      total.idleNanos += row.idleNanos;
+      total.syncWaits += row.syncWaits;
+      total.syncWaitNanos += row.syncWaitNanos;
+      for (std::size_t b = 0; b < kRuntimeQueueWaitBuckets; ++b) {
+        total.queueWait[b] += row.queueWait[b];
+      }
+    }
+    std::fprintf(out, "%-10s %10llu %10llu %10.3f %10.3f %10llu %12.3f\n",
+                 "total", static_cast<unsigned long long>(total.tasks),
+                 static_cast<unsigned long long>(total.chunks),
+                 millis(total.busyNanos), millis(total.idleNanos),
+                 static_cast<unsigned long long>(total.syncWaits),
+                 millis(total.syncWaitNanos));
+
+    std::uint64_t samples = 0;
+    for (std::uint64_t count : total.queueWait) {
+      samples += count;
+    }
+    std::fprintf(out, "queue wait (1 in %u tasks sampled): %llu samples\n",
+                 kQueueWaitSample, static_cast<unsigned long long>(samples));
+    if (samples == 0) {
+      return;
+    }
+    // Percentiles are reported as the upper bound of their bucket.
+    const double quantiles[] = {0.5, 0.9, 0.99, 1.0};
+    const char *labels[] = {"p50", "p90", "p99", "max"};
+    for (std::size_t q = 0; q < 4; ++q) {
+      std::uint64_t seen = 0;
+      std::size_t bucket = 0;
+      while (bucket + 1 < kRuntimeQueueWaitBuckets &&
+             (seen += total.queueWait[bucket]) <
+                 static_cast<std::uint64_t>(std::ceil(quantiles[q] * samples))) {
+        ++bucket;
+      }
+      std::fprintf(out, "  %s < %.3f us\n", labels[q],
+                   std::ldexp(1.0, static_cast<int>(bucket) + 1) / 1e3);
+    }
   }
 
-  std::size_t workerCount() const { return workers.size(); }
+  // Grows or shrinks the pool to `count` workers. Shrinking only asks the
+  // surplus workers to retire: each one finishes the task it is running,
+  // and anything left in its deque is stolen by the others.
+  void resize(std::size_t count) {
+    std::lock_guard<std::mutex> lock(resizeMutex);
+    std::size_t previous = activeWorkers.load();
+    if (count < previous) {
+      activeWorkers.store(count);
+      wakeAllWorkers();
+      return;
+    }
+
+    for (std::size_t i = previous; i < count; ++i) {
+      if (!queues[i]) {
+        queues[i] = std::make_unique<WorkQueue>();
+        stats[i] = std::make_unique<StatsRow>();
+      }
+    }
+    queueCount.store(std::max(queueCount.load(), count));
+    activeWorkers.store(count);
+    for (std::size_t i = previous; i < count; ++i) {
+      if (workers[i].joinable()) {
+        if (!workerRetired[i]) {
+          // It has not retired yet and now sees its slot is active again.
+          continue;
+        }
+        workers[i].join();
+      }
+      workerRetired[i] = false;
+      workers[i] = std::thread([this, i] { workerLoop(i); });
+    }
+  }
 
-  void parallelFor(void (*task)(void *, std::size_t, std::size_t), void *data,
-                   double start, double end, double step) {
+  // Runs `task` over every iteration. A reduction passes `reduce` and
+  // `combine` instead and gets the combined body values back, or `identity`
+  // when the loop is empty.
+  double parallelFor(void (*task)(void *, std::size_t, std::size_t),
+                     double (*reduce)(void *, std::size_t, std::size_t),
+                     double (*combine)(double, double), double identity,
+                     void *data, double start, double end, double step,
+                     const CallSite *site) {
     if (!(step > 0.0)) {
       std::fprintf(stderr, "Error: parfor step must be greater than 0\n");
-      return;
+      return identity;
     }
     if (!std::isfinite(start) || !std::isfinite(end) || !std::isfinite(step)) {
       std::fprintf(stderr, "Error: parfor bounds must be finite\n");
-      return;
+      return identity;
     }
+    // Batched async calls issued before the loop run alongside it.
+    publishBatch();
     if (!(end > start)) {
-      return;
+      return identity;
     }
 
     double span = end - start;
     std::size_t iterations =
         static_cast<std::size_t>(std::ceil(span / step));
     if (iterations == 0) {
-      return;
+      return identity;
+    }
+    bool inlined = runsInline(iterations, site);
+    if (inlined || hosted()) {
+      std::uint64_t callStart = tracer.enabled ? nowNanos() : 0;
+      double result =
+          inlined ? runInline(task, reduce, combine, data, iterations)
+                  : runHosted(task, reduce, combine, data, iterations);
+      addStat(statsRow().chunks, 1);
+      if (tracer.enabled) {
+        tracer.record(TraceKind::ParFor, site, callStart);
+      }
+      return result;
+    }
+
+    // A loop is tuned by its wrapper: the reduce wrapper for a reduction.
+    LoopTuning *tuning = nullptr;
+    LoopPlan plan{minGrain, 0, 0};
+    if (tuner.mode != TuneMode::Off) {
+      const void *wrapper = reduce ? reinterpret_cast<const void *>(reduce)
+                                   : reinterpret_cast<const void *>(task);
+      tuning = &tuner.find(wrapper, site, minGrain);
+      plan = tuner.plan(*tuning);
     }
+    std::uint64_t tuneStart = plan.epoch ? nowNanos() : 0;
+
+    auto *loop = new ParallelLoop;
+    loop->runtime = this;
+    loop->task = task;
+    loop->reduce = reduce;
+    loop->combine = combine;
+    loop->data = data;
+    loop->iterations = iterations;
+    loop->site = site;
+    loop->group.pending.store(iterations);
 
     std::size_t desiredChunks = std::max<std::size_t>(1, workerCount() * 4);
     std::size_t chunkCount = std::min(iterations, desiredChunks);
-    std::size_t grainSize = (iterations + chunkCount - 1) / chunkCount;
-
-    struct CompletionGroup {
-      std::mutex mutex;
-      std::condition_variable finished;
-      std::size_t pending = 0;
-    } group;
-
-    for (std::size_t begin = 0; begin < iterations; begin += grainSize) {
-      std::size_t chunkEnd = std::min(iterations, begin + grainSize);
-      {
-        std::lock_guard<std::mutex> lock(group.mutex);
-        ++group.pending;
-      }
-
-      enqueue([task, data, begin, chunkEnd, &group] {
-        task(data, begin, chunkEnd);
-        std::lock_guard<std::mutex> lock(group.mutex);
-        --group.pending;
-        if (group.pending == 0) {
-          group.finished.notify_all();
+    loop->grain = plan.grain;
+    loop->staticChunk = std::max(loop->grain, (iterations + chunkCount - 1) /
+                                                  chunkCount);
+
+    // The caller always participates. A caller from outside the pool is an
+    // extra thread, so it can be joined by every worker; a worker caller is
+    // joined by its peers. Never start more participants than grain-sized
+    // ranges, so a short loop does not wake the whole pool, or than tuning
+    // allows.
+    std::size_t grains = (iterations + loop->grain - 1) / loop->grain;
+    if (reduce && reduceOrder == ReduceOrder::Deterministic) {
+      loop->leafSize = reduceLeafSize(iterations);
+      std::size_t leafCount = (iterations + loop->leafSize - 1) / loop->leafSize;
+      loop->partials.resize(leafCount);
+      grains = leafCount;
+    }
+    if (plan.workers > 0) {
+      grains = std::min(grains, plan.workers);
+    }
+    std::size_t workers = workerCount();
+    std::size_t available = workers + (currentWorker == kNoWorker ? 1 : 0);
+    loop->participants = std::min(available, grains);
+
+    // The affinity schedule gives each of the first workers a block and
+    // queues that block's helper on the owner's own deque. Blocks longer than
+    // the packed bounds can describe fall back to the guided cursor.
+    std::size_t blockCount = std::min(workers, grains);
+    std::size_t blockSize = (iterations + blockCount - 1) / blockCount;
+    if (loopSchedule == LoopSchedule::Affinity && loop->leafSize == 0 &&
+        blockSize <= 0xffffffffu) {
+      loop->blocks.reset(new LoopBlock[blockCount]);
+      loop->blockCount = blockCount;
+      for (std::size_t b = 0; b < blockCount; ++b) {
+        std::size_t begin = std::min(b * blockSize, iterations);
+        std::size_t end = std::min(begin + blockSize, iterations);
+        loop->blocks[b].begin = begin;
+        loop->blocks[b].bounds.store(static_cast<std::uint64_t>(end - begin)
+                                         << 32,
+                                     std::memory_order_relaxed);
+      }
+      // A caller that owns no block joins the owners.
+      loop->participants = blockCount + (currentWorker < blockCount ? 0 : 1);
+    }
+    if (reduce && loop->leafSize == 0) {
+      loop->partials.resize(loop->participants);
+    }
+
+    std::size_t helpers = loop->participants - 1;
+    loop->refs.store(1 + helpers);
+    if (loop->blockCount > 0) {
+      for (std::size_t b = 0; b < loop->blockCount; ++b) {
+        if (b != currentWorker) {
+          pushPinned(b, Task{&AsyncRuntime::runLoopHelper, loop, nullptr, true});
         }
-      });
+      }
+      if (sleepingWorkers.load() > 0) {
+        wakeAllWorkers();
+      }
+    } else {
+      for (std::size_t i = 0; i < helpers; ++i) {
+        push(Task{&AsyncRuntime::runLoopHelper, loop});
+      }
     }
 
-    std::unique_lock<std::mutex> lock(group.mutex);
-    group.finished.wait(lock, [&group] { return group.pending == 0; });
+    // Work on the loop directly, then run other queued work (including any
+    // nested loops' helpers) until the helpers finish their ranges.
+    std::uint64_t callStart = tracer.enabled ? nowNanos() : 0;
+    participate(*loop, 0);
+    helpUntilDone(loop->group.signal);
+    if (tracer.enabled) {
+      tracer.record(TraceKind::ParFor, site, callStart);
+    }
+    if (plan.epoch) {
+      tuner.report(*tuning, plan, nowNanos() - tuneStart, iterations, workers);
+    }
+    double result = reduce ? combinePartials(*loop) : 0.0;
+    releaseLoop(loop);
+    return result;
   }
 };
 
@@ -173,21 +3055,174 @@ AsyncRuntime &getRuntime() {
 
 } // namespace
 
-extern "C" double __compiler_sync_tasks() {
-  // Runtime entry point for sync().
-  getRuntime().sync();
-  return 0.0;
+extern "C" unsigned __compiler_cpu_level() {
+  // Called by the version selector of multiversioned functions as the
+  // program loads, before main. COMPILER_CPU_LEVEL can lower the level to
+  // force an older version, but never raise it.
+  static const unsigned level = [] {
+    unsigned detected = detectCpuLevel();
+    std::size_t cap = readPositiveEnv("COMPILER_CPU_LEVEL");
+    return cap > 0 && cap < detected ? static_cast<unsigned>(cap) : detected;
+  }();
+  return level;
+}
+
+extern "C" void __compiler_group_enter(void *storage) {
+  // Called by compiled code before the first async, await, or sync of an
+  // activation. `storage` is kTaskGroupBytes in the caller's frame.
+  new (storage) TaskGroup;
+}
+
+extern "C" void __compiler_group_leave(void *storage, const CallSite *site) {
+  // Called by compiled code before the activation returns: waits for the
+  // tasks it issued and drops the handles it never awaited. `site` names the
+  // function, as for every entry point below that takes one.
+  auto *group = static_cast<TaskGroup *>(storage);
+  getRuntime().sync(*group, site, TraceKind::Join);
+  group->~TaskGroup();
+}
+
+extern "C" int __compiler_set_num_workers(std::size_t count) {
+  // Before the runtime is first used this sets how many workers it starts,
+  // taking precedence over COMPILER_NUM_WORKERS; afterwards it resizes the
+  // running pool. Returns 0, or -1 when `count` is out of range.
+  if (count == 0 || count > kMaxWorkers) {
+    std::fprintf(stderr, "Error: worker count must be between 1 and %zu\n",
+                 kMaxWorkers);
+    return -1;
+  }
+  {
+    std::lock_guard<std::mutex> lock(executorMutex);
+    if (installedExecutor.submit) {
+      std::fprintf(stderr, "Error: a host executor replaces the worker pool\n");
+      return -1;
+    }
+  }
+  requestedWorkerCount.store(count);
+  getRuntime().resize(count);
+  return 0;
+}
+
+extern "C" std::size_t __compiler_num_workers() {
+  // Current pool size; 0 under a host executor.
+  return getRuntime().workerCount();
+}
+
+extern "C" int __compiler_set_executor(const CompilerExecutor *executor) {
+  // Declared in runtime_executor.h for host programs.
+  if (executor &&
+      (!executor->submit || !executor->parallel_for || !executor->wait)) {
+    std::fprintf(stderr, "Error: an executor needs all three callbacks\n");
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(executorMutex);
+  if (runtimeStarted) {
+    std::fprintf(stderr,
+                 "Error: the executor must be set before the runtime starts\n");
+    return -1;
+  }
+  installedExecutor = executor ? *executor : CompilerExecutor{};
+  return 0;
+}
+
+extern "C" std::size_t __compiler_runtime_stats(RuntimeWorkerStats *rows,
+                                                std::size_t capacity) {
+  // Declared in runtime_stats.h for host programs.
+  return getRuntime().collectStats(rows, capacity);
 }
 
-extern "C" double __compiler_async_call(void (*task)(void *), void *data) {
-  // Runtime entry point for async
-  getRuntime().enqueue([task, data] { task(data); });
+extern "C" double __compiler_sync_tasks(void *group, const CallSite *site) {
+  // Runtime entry point for sync(). Waits only for the caller's group.
+  getRuntime().sync(*static_cast<TaskGroup *>(group), site, TraceKind::Sync);
   return 0.0;
 }
 
+extern "C" void *__compiler_task_alloc(std::size_t argCount) {
+  // Argument storage for the next __compiler_async_call.
+  return allocateTaskRecord(argCount)->args;
+}
+
+extern "C" double __compiler_async_call(void *group, double (*task)(void *),
+                                        void *data, const CallSite *site) {
+  // Runtime entry point for async. `data` comes from __compiler_task_alloc;
+  // the returned handle can be passed to __compiler_await.
+  return getRuntime().enqueue(*static_cast<TaskGroup *>(group), task, data,
+                              false, false, site);
+}
+
+extern "C" double __compiler_async_detached(void *group,
+                                            double (*task)(void *),
+                                            void *data, const CallSite *site) {
+  // Runtime entry point for an async whose value is discarded, such as the
+  // body of a for loop. Returns 0.0 instead of a handle.
+  return getRuntime().enqueue(*static_cast<TaskGroup *>(group), task, data,
+                              true, false, site);
+}
+
+extern "C" double __compiler_async_call_batched(void *group,
+                                                double (*task)(void *),
+                                                void *data,
+                                                const CallSite *site) {
+  // The two entry points for an async inside a `for` loop. The task waits
+  // in the calling thread's batch until it fills, the loop ends
+  // (__compiler_async_flush), or the thread waits for anything.
+  return getRuntime().enqueue(*static_cast<TaskGroup *>(group), task, data,
+                              false, true, site);
+}
+
+extern "C" double __compiler_async_detached_batched(void *group,
+                                                    double (*task)(void *),
+                                                    void *data,
+                                                    const CallSite *site) {
+  return getRuntime().enqueue(*static_cast<TaskGroup *>(group), task, data,
+                              true, true, site);
+}
+
+extern "C" double __compiler_async_call_after(void *group,
+                                              double (*task)(void *),
+                                              void *data, const CallSite *site,
+                                              const double *after,
+                                              std::size_t afterCount) {
+  // The two entry points for `async f(...) after (h1, h2, ...)`. `after`
+  // holds the handles, each of which must come from this activation and not
+  // have been awaited yet: an awaited handle's record may already be
+  // recycled. The task is queued once their tasks have finished. These
+  // calls are never batched.
+  return getRuntime().enqueue(*static_cast<TaskGroup *>(group), task, data,
+                              false, false, site, after, afterCount);
+}
+
+extern "C" double __compiler_async_detached_after(
+    void *group, double (*task)(void *), void *data, const CallSite *site,
+    const double *after, std::size_t afterCount) {
+  return getRuntime().enqueue(*static_cast<TaskGroup *>(group), task, data,
+                              true, false, site, after, afterCount);
+}
+
+extern "C" void __compiler_async_flush() {
+  // Called by compiled code when its outermost `for` loop with a batched
+  // async exits.
+  getRuntime().flushBatch();
+}
+
+extern "C" double __compiler_await(void *group, double handle) {
+  // Runtime entry point for await.
+  return getRuntime().await(*static_cast<TaskGroup *>(group), handle);
+}
+
 extern "C" double __compiler_parfor(
     void (*task)(void *, std::size_t, std::size_t), void *data, double start,
-    double end, double step) {
-  getRuntime().parallelFor(task, data, start, end, step);
-  return 0.0;
+    double end, double step, const CallSite *site) {
+  return getRuntime().parallelFor(task, nullptr, nullptr, 0.0, data, start,
+                                  end, step, site);
+}
+
+extern "C" double __compiler_parfor_reduce(
+    double (*task)(void *, std::size_t, std::size_t),
+    double (*combine)(double, double), double identity, void *data,
+    double start, double end, double step, const CallSite *site) {
+  // Runtime entry point for `parfor ... reduce op`. `task` returns the folded
+  // body values of one non-empty range and `combine` applies the operator.
+  return getRuntime().parallelFor(nullptr, task, combine, identity, data,
+                                  start, end, step, site);
 }
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+
+// Lets a host program run compiled parallel code on its own thread pool
+// instead of the worker pool in runtime.cpp. Once an executor is installed,
+// `async` calls go to `submit`, `parfor` loops to `parallel_for`, and
+// `sync()`, `await` and function-exit joins to `wait`. The runtime then
+// starts no threads of its own.
+struct CompilerExecutor {
+  // Passed back unchanged as the first argument of every callback.
+  void *context;
+  // Runs `run(arg)` once, on any thread, either later or before returning.
+  void (*submit)(void *context, void (*run)(void *), void *arg);
+  // Calls `body(arg, begin, end)` over disjoint ranges that together cover
+  // [0, iterations), in any order and on any threads, and returns once all
+  // of them have returned. The calling thread may run ranges itself.
+  void (*parallel_for)(void *context, std::size_t iterations,
+                       void (*body)(void *arg, std::size_t begin,
+                                    std::size_t end),
+                       void *arg);
+  // Returns once `done(arg)` returns nonzero. `done` only changes when a
+  // function passed to `submit` returns, so a blocking wait can re-check it
+  // whenever one finishes. Tasks can wait on each other, so a pool thread
+  // that waits should run other submitted work meanwhile rather than block.
+  void (*wait)(void *context, int (*done)(void *arg), void *arg);
+};
+
+// Installs `executor`, which is copied, or the built-in pool again when it
+// is null. Only possible before compiled code first uses the runtime.
+// Returns 0, or -1 when the runtime is already running or a callback is
+// missing.
+extern "C" int __compiler_set_executor(const CompilerExecutor *executor);
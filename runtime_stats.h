@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Counters the parallel runtime in runtime.cpp keeps while it runs, for host
+// programs that want to see how compiled code used the worker pool. Times
+// are in nanoseconds.
+
+// Bucket k of the queue-wait histogram counts waits of [2^k, 2^(k+1)) ns.
+constexpr std::size_t kRuntimeQueueWaitBuckets = 32;
+
+struct RuntimeWorkerStats {
+  // Async tasks and parfor helpers run.
+  std::uint64_t tasks;
+  // Parfor iteration ranges run.
+  std::uint64_t chunks;
+  // Time alive and not parked. Only pool workers report it.
+  std::uint64_t busyNanos;
+  // Time spinning or parked, waiting for work or for something this thread
+  // waits on.
+  std::uint64_t idleNanos;
+  // sync() calls and function-exit joins that found tasks still running,
+  // and the time they spent until those finished (helping included).
+  std::uint64_t syncWaits;
+  std::uint64_t syncWaitNanos;
+  // Time from enqueue to start for a sample of the tasks this thread ran.
+  std::uint64_t queueWait[kRuntimeQueueWaitBuckets];
+};
+
+// Copies up to `capacity` rows into `rows`: one per worker slot the pool has
+// started, in slot order, then one for all threads outside the pool. Returns
+// the number of rows there are, so a first call can pass no buffer.
+extern "C" std::size_t __compiler_runtime_stats(RuntimeWorkerStats *rows,
+                                                std::size_t capacity);
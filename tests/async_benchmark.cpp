@@ -0,0 +1,66 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+double spawnflat(double);
+double spawntree(double);
+double spawnjoin(double);
+}
+
+// Deliberately tiny task body so the benchmark measures scheduling overhead.
+extern "C" double tick(double x) {
+  double value = x;
+  for (int i = 0; i < 16; ++i) {
+    value = value * 0.5 + 1.0;
+  }
+  return value;
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+template <typename Func> double timeMillis(Func &&func, int trials) {
+  double totalMillis = 0.0;
+  for (int i = 0; i < trials; ++i) {
+    auto start = Clock::now();
+    func();
+    auto end = Clock::now();
+    totalMillis +=
+        std::chrono::duration<double, std::milli>(end - start).count();
+  }
+  return totalMillis / static_cast<double>(trials);
+}
+
+} // namespace
+
+int main() {
+  constexpr double kFlatTasks = 200000.0;
+  constexpr double kTreeDepth = 17.0;
+  constexpr int kTrials = 3;
+
+  const char *workers = std::getenv("COMPILER_NUM_WORKERS");
+  const char *batch = std::getenv("COMPILER_ASYNC_BATCH");
+  double treeTasks = std::pow(2.0, kTreeDepth + 1.0) - 1.0;
+  double joinTasks = std::pow(2.0, kTreeDepth) - 1.0;
+
+  // Warm the pool so thread startup is not part of the first measurement.
+  spawnflat(1.0);
+
+  double flatMs = timeMillis([] { spawnflat(kFlatTasks); }, kTrials);
+  double treeMs = timeMillis([] { spawntree(kTreeDepth); }, kTrials);
+  double joinMs = timeMillis([] { spawnjoin(kTreeDepth); }, kTrials);
+
+  std::printf("async benchmark workers=%s batch=%s trials=%d\n",
+              workers ? workers : "default", batch ? batch : "default",
+              kTrials);
+  std::printf("spawnflat  %.0f tasks  %.3f ms  %.0f tasks/ms\n", kFlatTasks,
+              flatMs, kFlatTasks / flatMs);
+  std::printf("spawntree  %.0f tasks  %.3f ms  %.0f tasks/ms\n", treeTasks,
+              treeMs, treeTasks / treeMs);
+  std::printf("spawnjoin  %.0f tasks  %.3f ms  %.0f tasks/ms\n", joinTasks,
+              joinMs, joinTasks / joinMs);
+  return 0;
+}
@@ -0,0 +1,235 @@
+#include "../runtime_executor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+int __compiler_set_num_workers(std::size_t);
+std::size_t __compiler_num_workers();
+double execsum(double);
+double execcount(double);
+double execfib(double);
+double execfanout(double);
+}
+
+namespace {
+
+constexpr double kTolerance = 1e-9;
+int failures = 0;
+std::atomic<int> bumps{0};
+
+void expectClose(const char *name, double actual, double expected) {
+  if (std::fabs(actual - expected) > kTolerance) {
+    std::fprintf(stderr, "FAIL %s: expected %.12f, got %.12f\n", name, expected,
+                 actual);
+    ++failures;
+    return;
+  }
+  std::printf("PASS %s = %.12f\n", name, actual);
+}
+
+// Minimal host pool: one locked queue, and waits that run queued jobs until
+// their condition holds. Every finished job wakes the waiters, since only a
+// finished job can change what they wait for.
+class HostPool {
+  struct Job {
+    void (*run)(void *);
+    void *arg;
+  };
+
+  // One parallel_for call; jobs and the caller claim chunks from `next`.
+  struct Loop {
+    void (*body)(void *, std::size_t, std::size_t);
+    void *arg;
+    std::size_t iterations;
+    std::size_t chunk;
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> unfinished;
+    std::atomic<std::size_t> helpers;
+
+    void runChunks() {
+      std::size_t begin;
+      while ((begin = next.fetch_add(chunk)) < iterations) {
+        std::size_t end = std::min(begin + chunk, iterations);
+        body(arg, begin, end);
+        unfinished.fetch_sub(end - begin);
+      }
+    }
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<Job> jobs;
+  std::uint64_t finishedJobs = 0;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+
+  bool runOne(std::unique_lock<std::mutex> &lock) {
+    if (jobs.empty()) {
+      return false;
+    }
+    Job job = jobs.front();
+    jobs.pop_front();
+    lock.unlock();
+    job.run(job.arg);
+    lock.lock();
+    ++finishedJobs;
+    changed.notify_all();
+    return true;
+  }
+
+  static void runLoopHelper(void *arg) {
+    auto *loop = static_cast<Loop *>(arg);
+    loop->runChunks();
+    loop->helpers.fetch_sub(1);
+  }
+
+  static int loopDone(void *arg) {
+    auto *loop = static_cast<Loop *>(arg);
+    return loop->unfinished.load() == 0 && loop->helpers.load() == 0;
+  }
+
+public:
+  std::atomic<int> submitted{0};
+  std::atomic<int> loops{0};
+  std::atomic<int> waits{0};
+
+  explicit HostPool(std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+      threads.emplace_back([this] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+          if (!runOne(lock)) {
+            changed.wait(lock);
+          }
+        }
+      });
+    }
+  }
+
+  ~HostPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  void submit(void (*run)(void *), void *arg) {
+    ++submitted;
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back({run, arg});
+    changed.notify_all();
+  }
+
+  void wait(int (*done)(void *), void *arg) {
+    ++waits;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!done(arg)) {
+      std::uint64_t seen = finishedJobs;
+      if (!runOne(lock)) {
+        changed.wait(lock, [&] {
+          return finishedJobs != seen || !jobs.empty();
+        });
+      }
+    }
+  }
+
+  void parallelFor(std::size_t iterations,
+                   void (*body)(void *, std::size_t, std::size_t), void *arg) {
+    ++loops;
+    Loop loop;
+    loop.body = body;
+    loop.arg = arg;
+    loop.iterations = iterations;
+    std::size_t parts = std::min(iterations, threads.size() * 4);
+    loop.chunk = (iterations + parts - 1) / parts;
+    loop.unfinished.store(iterations);
+    loop.helpers.store(threads.size());
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+      submit(&HostPool::runLoopHelper, &loop);
+    }
+    loop.runChunks();
+    // The helpers hold a pointer to the loop, so wait for them too.
+    wait(&HostPool::loopDone, &loop);
+  }
+};
+
+constexpr std::size_t kHostThreads = 3;
+HostPool *hostPool = nullptr;
+
+CompilerExecutor hostExecutor() {
+  CompilerExecutor executor{};
+  executor.context = hostPool;
+  executor.submit = [](void *context, void (*run)(void *), void *arg) {
+    static_cast<HostPool *>(context)->submit(run, arg);
+  };
+  executor.parallel_for = [](void *context, std::size_t iterations,
+                             void (*body)(void *, std::size_t, std::size_t),
+                             void *arg) {
+    static_cast<HostPool *>(context)->parallelFor(iterations, body, arg);
+  };
+  executor.wait = [](void *context, int (*done)(void *), void *arg) {
+    static_cast<HostPool *>(context)->wait(done, arg);
+  };
+  return executor;
+}
+
+} // namespace
+
+extern "C" double hostbump(double) {
+  ++bumps;
+  return 0.0;
+}
+
+int main() {
+  // The pool outlives the runtime, whose teardown runs at exit.
+  hostPool = new HostPool(kHostThreads);
+  CompilerExecutor executor = hostExecutor();
+  CompilerExecutor incomplete = executor;
+  incomplete.wait = nullptr;
+  expectClose("set incomplete executor", __compiler_set_executor(&incomplete),
+              -1.0);
+  expectClose("set executor", __compiler_set_executor(&executor), 0.0);
+  expectClose("set worker count", __compiler_set_num_workers(4), -1.0);
+
+  expectClose("execsum", execsum(10000.0), 49995000.0);
+  expectClose("execfib", execfib(16.0), 987.0);
+
+  bumps = 0;
+  expectClose("execcount return", execcount(1000.0), 0.0);
+  expectClose("execcount bumps", bumps.load(), 1000.0);
+
+  bumps = 0;
+  expectClose("execfanout return", execfanout(200.0), 0.0);
+  expectClose("execfanout bumps", bumps.load(), 200.0);
+
+  // Everything went through the host pool, and the runtime started no
+  // workers of its own.
+  expectClose("host submits", hostPool->submitted.load() > 0 ? 1.0 : 0.0, 1.0);
+  expectClose("host loops", hostPool->loops.load() > 0 ? 1.0 : 0.0, 1.0);
+  expectClose("host waits", hostPool->waits.load() > 0 ? 1.0 : 0.0, 1.0);
+  expectClose("runtime workers", static_cast<double>(__compiler_num_workers()),
+              0.0);
+  expectClose("set executor after start", __compiler_set_executor(&executor),
+              -1.0);
+
+  if (failures != 0) {
+    std::fprintf(stderr, "%d executor check(s) failed\n", failures);
+    return 1;
+  }
+
+  std::printf("All executor checks passed\n");
+  return 0;
+}
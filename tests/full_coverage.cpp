@@ -1,6 +1,11 @@
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -24,6 +29,70 @@ extern "C" double printd(double x) {
   return x;
 }
 
+namespace {
+
+// Calls to bump() since the last reset, and the sum of their arguments.
+std::atomic<long> bumpCount{0};
+std::atomic<long> bumpSum{0};
+
+void resetBumps() {
+  bumpCount.store(0);
+  bumpSum.store(0);
+}
+
+} // namespace
+
+extern "C" double bump(double x) {
+  bumpSum.fetch_add(static_cast<long>(x));
+  bumpCount.fetch_add(1);
+  return x;
+}
+
+// Waits up to a second for `n` bumps without running tasks itself, so it
+// only returns n if the tasks were published. Returns -1 on timeout.
+extern "C" double waitbumps(double n) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  while (bumpCount.load() < static_cast<long>(n)) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return -1.0;
+    }
+    std::this_thread::yield();
+  }
+  return n;
+}
+
+namespace {
+
+// Arguments passed to stamp() and slowstamp() since the last reset, in the
+// order the calls ran.
+std::mutex stampMutex;
+std::vector<double> stamps;
+
+void resetStamps() {
+  std::lock_guard<std::mutex> lock(stampMutex);
+  stamps.clear();
+}
+
+std::vector<double> snapshotStamps() {
+  std::lock_guard<std::mutex> lock(stampMutex);
+  return stamps;
+}
+
+} // namespace
+
+// Records `x` and returns how many calls were recorded before it.
+extern "C" double stamp(double x) {
+  std::lock_guard<std::mutex> lock(stampMutex);
+  stamps.push_back(x);
+  return static_cast<double>(stamps.size() - 1);
+}
+
+// Like stamp(), but first sleeps so that tasks started too early get ahead.
+extern "C" double slowstamp(double x) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  return stamp(x);
+}
+
 extern "C" double binary_colon(double x, double y) asm("_binary:");
 extern "C" double binary_colon(double x, double y) { return x - y; }
 
@@ -64,8 +133,54 @@ double loopnostep();
 double usesync();
 double useasync();
 double useasync4();
+double awaitfib(double);
+double awaitinorder(double);
+double syncintask(double);
+double syncfanout(double);
+double batchfanout(double);
+double batchawait(double);
+double batchflush(double);
+double afterjoin();
+double afterchain();
+double afterdone(double);
+double afterfanout(double);
+double priorityawait(double);
+double priorityfanout(double);
+double asynclow(double);
+}
+
+namespace {
+
+// Calls async code from several host threads at once. Each call's sync()
+// must only wait for its own tasks.
+void checkConcurrentHostThreads() {
+  constexpr int kThreads = 4;
+  constexpr int kRounds = 50;
+  std::vector<int> threadFailures(kThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([t, &threadFailures] {
+      for (int round = 0; round < kRounds; ++round) {
+        if (syncfanout(32.0) != 32.0 || awaitfib(12.0) != 144.0 ||
+            syncintask(t + round) != 2.0 * (t + round)) {
+          ++threadFailures[t];
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  int total = 0;
+  for (int count : threadFailures) {
+    total += count;
+  }
+  checkClose("concurrent host threads", total, 0.0);
 }
 
+} // namespace
+
 int main() {
   checkClose("identity", identity(1.5), 1.5);
   checkClose("add", add(2.0, 3.0), 5.0);
@@ -103,8 +218,36 @@ int main() {
   checkClose("useprintd", useprintd(42.0), 42.0);
   checkClose("loopnostep", loopnostep(), 0.0);
   checkClose("usesync", usesync(), 1.0);
-  checkClose("useasync", useasync(), 0.0);
-  checkClose("useasync4", useasync4(), 0.0);
+  checkClose("useasync", useasync(), 1.0);
+  checkClose("useasync4", useasync4(), 10.0);
+  checkClose("awaitfib", awaitfib(18.0), 2584.0);
+  checkClose("awaitinorder", awaitinorder(5.0), -5.0);
+  checkClose("syncintask", syncintask(4.0), 8.0);
+  checkClose("syncfanout", syncfanout(16.0), 16.0);
+  resetBumps();
+  checkClose("batchfanout", batchfanout(100.0), 0.0);
+  checkClose("batchfanout count", bumpCount.load(), 100.0);
+  checkClose("batchfanout sum", bumpSum.load(), 4950.0);
+  checkClose("batchawait", batchawait(40.0), 40.0);
+  resetBumps();
+  checkClose("batchflush", batchflush(5.0), 5.0);
+  resetStamps();
+  checkClose("afterjoin", afterjoin(), 2.0);
+  resetStamps();
+  checkClose("afterchain", afterchain(), 2.0);
+  checkClose("afterdone", afterdone(4.0), 28.0);
+  resetStamps();
+  checkClose("afterfanout", afterfanout(8.0), 0.0);
+  std::vector<double> fanout = snapshotStamps();
+  checkClose("afterfanout count", fanout.size(), 9.0);
+  checkClose("afterfanout first", fanout.empty() ? 0.0 : fanout[0], 1.0);
+  checkClose("priorityawait", priorityawait(3.0), 15.0);
+  resetBumps();
+  checkClose("priorityfanout", priorityfanout(50.0), 0.0);
+  checkClose("priorityfanout count", bumpCount.load(), 100.0);
+  checkClose("priorityfanout sum", bumpSum.load(), 2450.0);
+  checkClose("asynclow", asynclow(2.0), 3.0);
+  checkConcurrentHostThreads();
 
   if (failures != 0) {
     std::fprintf(stderr, "%d correctness check(s) failed\n", failures);
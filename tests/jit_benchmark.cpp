@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Times whole shell commands, from start to exit, so that compiling,
+// linking, and process start-up all count.
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int kDefaultRuns = 10;
+
+bool timeCommand(const std::string &label, const std::string &command,
+                 int runs) {
+  std::string quiet = "(" + command + ") >/dev/null";
+  std::vector<double> millis;
+  for (int i = 0; i < runs; ++i) {
+    auto start = Clock::now();
+    int status = std::system(quiet.c_str());
+    auto end = Clock::now();
+    if (status != 0) {
+      std::fprintf(stderr, "%s failed: %s\n", label.c_str(), command.c_str());
+      return false;
+    }
+    millis.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  std::sort(millis.begin(), millis.end());
+  std::printf("%-5s min %8.1f ms  p50 %8.1f ms  max %8.1f ms  (%d runs)\n",
+              label.c_str(), millis.front(), millis[millis.size() / 2], millis.back(),
+              runs);
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <label>=<command>...\n", argv[0]);
+    return 1;
+  }
+  int runs = kDefaultRuns;
+  if (const char *text = std::getenv("BENCHMARK_RUNS")) {
+    runs = std::max(1, std::atoi(text));
+  }
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    std::size_t equals = arg.find('=');
+    if (equals == std::string::npos) {
+      std::fprintf(stderr, "Expected <label>=<command>, got %s\n", argv[i]);
+      return 1;
+    }
+    if (!timeCommand(arg.substr(0, equals), arg.substr(equals + 1), runs)) {
+      return 1;
+    }
+  }
+  return 0;
+}
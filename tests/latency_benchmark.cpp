@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+extern "C" {
+double ping(double);
+double pinghigh(double);
+double parallelburn(double);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Start time of the last task, and the sample it belongs to.
+std::atomic<Clock::rep> startedAt{0};
+std::atomic<double> startedSample{-1.0};
+
+} // namespace
+
+extern "C" double taskstart(double x) {
+  startedAt.store(Clock::now().time_since_epoch().count());
+  startedSample.store(x);
+  return x;
+}
+
+extern "C" double burn(double x) {
+  double value = x + 1.0;
+  for (int i = 0; i < 400; ++i) {
+    value = std::sin(value) + std::cos(value) + std::sqrt(value + 2.0);
+  }
+  return value;
+}
+
+extern "C" double waitstarted(double x) {
+  // Yield rather than spin, so the pool can run even on a single CPU.
+  while (startedSample.load() != x) {
+    std::this_thread::yield();
+  }
+  return 0.0;
+}
+
+namespace {
+
+void busyWait(std::chrono::nanoseconds gap) {
+  auto until = Clock::now() + gap;
+  while (Clock::now() < until) {
+  }
+}
+
+// Times `samples` submissions, from the call that enqueues the task to the
+// task starting, with `gap` of idle time on the submitting thread before
+// each one. A long gap lets the workers park; a short one catches them
+// still looking for work.
+void measure(const char *label, double (*submit)(double), int samples,
+             std::chrono::nanoseconds gap, bool sleep, double &nextSample) {
+  std::vector<double> micros;
+  micros.reserve(samples);
+  for (int i = 0; i < samples; ++i) {
+    if (sleep) {
+      std::this_thread::sleep_for(gap);
+    } else {
+      busyWait(gap);
+    }
+    double sample = nextSample++;
+    Clock::rep submitted = Clock::now().time_since_epoch().count();
+    submit(sample);
+    Clock::duration latency(startedAt.load() - submitted);
+    micros.push_back(
+        std::chrono::duration<double, std::micro>(latency).count());
+  }
+
+  std::sort(micros.begin(), micros.end());
+  auto percentile = [&](double p) {
+    return micros[static_cast<std::size_t>(p * (micros.size() - 1))];
+  };
+  std::printf("%-10s %6d tasks  p50 %8.2f us  p90 %8.2f us  p99 %8.2f us\n",
+              label, samples, percentile(0.5), percentile(0.9),
+              percentile(0.99));
+}
+
+} // namespace
+
+int main() {
+  const char *spin = std::getenv("COMPILER_SPIN_US");
+  double nextSample = 0.0;
+
+  // Start the pool so thread creation is not measured.
+  ping(nextSample++);
+
+  std::printf("latency benchmark spin_us=%s\n", spin ? spin : "default");
+  measure("idle pool", ping, 500, std::chrono::milliseconds(2), true,
+          nextSample);
+  measure("warm pool", ping, 20000, std::chrono::microseconds(5), false,
+          nextSample);
+
+  // A host thread keeps a large parfor running the whole time, so every
+  // worker is busy with its ranges when a ping arrives.
+  std::atomic<bool> stop{false};
+  std::thread burner([&stop] {
+    while (!stop.load()) {
+      parallelburn(20000.0);
+    }
+  });
+  measure("busy pool", ping, 100, std::chrono::milliseconds(2), true,
+          nextSample);
+  measure("busy high", pinghigh, 100, std::chrono::milliseconds(2), true,
+          nextSample);
+  stop.store(true);
+  burner.join();
+  return 0;
+}
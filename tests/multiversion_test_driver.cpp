@@ -0,0 +1,149 @@
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+// The versions have names C++ cannot spell, so they are bound by symbol.
+#if defined(__APPLE__)
+#define SYMBOL(name) "_" name
+#else
+#define SYMBOL(name) name
+#endif
+
+using Version = double (*)(double);
+
+extern "C" {
+unsigned __compiler_cpu_level();
+double mvdot(double);
+double mvfib(double);
+double mvfanout(double);
+double mvprobe(double);
+double mvcaller(double);
+
+double mvdotBaseline(double) asm(SYMBOL("mvdot.x86-64"));
+double mvdotV3(double) asm(SYMBOL("mvdot.x86-64-v3"));
+double mvdotV4(double) asm(SYMBOL("mvdot.x86-64-v4"));
+double mvfibBaseline(double) asm(SYMBOL("mvfib.x86-64"));
+double mvfibV3(double) asm(SYMBOL("mvfib.x86-64-v3"));
+double mvfibV4(double) asm(SYMBOL("mvfib.x86-64-v4"));
+double mvprobeBaseline(double) asm(SYMBOL("mvprobe.x86-64"));
+double mvprobeV3(double) asm(SYMBOL("mvprobe.x86-64-v3"));
+double mvprobeV4(double) asm(SYMBOL("mvprobe.x86-64-v4"));
+}
+
+namespace {
+
+constexpr double kTolerance = 1e-9;
+int failures = 0;
+std::atomic<int> bumps{0};
+// Where the last mvwhere call returns to, inside the version that made it.
+std::uintptr_t probeReturn = 0;
+
+void expectClose(const char *name, double actual, double expected) {
+  if (std::fabs(actual - expected) > kTolerance) {
+    std::fprintf(stderr, "FAIL %s: expected %.12f, got %.12f\n", name, expected,
+                 actual);
+    ++failures;
+    return;
+  }
+  std::printf("PASS %s = %.12f\n", name, actual);
+}
+
+struct VersionSet {
+  const char *name;
+  // Indexed by the x86-64 level each version is compiled for; the test
+  // compiles no x86-64-v2 version.
+  Version versions[5];
+  double argument;
+  double expected;
+};
+
+// The stub must call the highest version at or below the CPU's level. The
+// pointer it calls through is internal to the object, so the version that
+// ran is the one whose code holds mvprobe's return address: the one that
+// starts closest below it.
+void checkSelection(const VersionSet &set, unsigned level) {
+  unsigned expectedLevel = 0;
+  for (unsigned l = 1; l <= 4 && l <= level; ++l) {
+    if (set.versions[l]) {
+      expectedLevel = l;
+    }
+  }
+  mvprobe(set.argument);
+  unsigned selectedLevel = 0;
+  std::uintptr_t selectedStart = 0;
+  for (unsigned l = 1; l <= 4; ++l) {
+    auto start = reinterpret_cast<std::uintptr_t>(set.versions[l]);
+    if (set.versions[l] && start <= probeReturn && start >= selectedStart) {
+      selectedLevel = l;
+      selectedStart = start;
+    }
+  }
+  if (selectedLevel != expectedLevel) {
+    std::fprintf(stderr,
+                 "FAIL %s: level %u ran version %u instead of version %u\n",
+                 set.name, level, selectedLevel, expectedLevel);
+    ++failures;
+  } else {
+    std::printf("PASS %s selects version %u\n", set.name, expectedLevel);
+  }
+}
+
+// Every version the CPU can run must compute the same result.
+void checkVersions(const VersionSet &set, unsigned level) {
+  for (unsigned l = 1; l <= 4 && l <= level; ++l) {
+    if (set.versions[l]) {
+      char label[64];
+      std::snprintf(label, sizeof(label), "%s version %u", set.name, l);
+      expectClose(label, set.versions[l](set.argument), set.expected);
+    }
+  }
+}
+
+} // namespace
+
+extern "C" double mvbump(double x) {
+  bumps.fetch_add(1);
+  return x;
+}
+
+extern "C" double mvwhere(double x) {
+  probeReturn = reinterpret_cast<std::uintptr_t>(__builtin_return_address(0));
+  return x;
+}
+
+int main() {
+  // COMPILER_CPU_LEVEL lowers this to force an older version.
+  unsigned level = __compiler_cpu_level();
+  std::printf("cpu level %u\n", level);
+
+  VersionSet probe{"mvprobe",
+                   {nullptr, mvprobeBaseline, nullptr, mvprobeV3, mvprobeV4},
+                   2.0,
+                   3.0};
+  checkSelection(probe, level);
+  checkVersions(probe, level);
+  checkVersions({"mvdot",
+                 {nullptr, mvdotBaseline, nullptr, mvdotV3, mvdotV4},
+                 1000.0,
+                 249750.0},
+                level);
+  checkVersions({"mvfib",
+                 {nullptr, mvfibBaseline, nullptr, mvfibV3, mvfibV4},
+                 20.0,
+                 6765.0},
+                level);
+
+  expectClose("mvdot", mvdot(1000.0), 249750.0);
+  expectClose("mvfib", mvfib(20.0), 6765.0);
+  expectClose("mvfanout", mvfanout(64.0), 0.0);
+  expectClose("mvfanout count", bumps.load(), 64.0);
+  expectClose("mvcaller", mvcaller(10.0), 56.0);
+
+  if (failures != 0) {
+    std::fprintf(stderr, "%d multiversion check(s) failed\n", failures);
+    return 1;
+  }
+  std::printf("All multiversion checks passed\n");
+  return 0;
+}
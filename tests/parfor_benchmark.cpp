@@ -1,49 +1,163 @@
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <vector>
 
 extern "C" {
 double serialburn(double);
 double parallelburn(double);
+double skewedserialburn(double);
+double skewedparallelburn(double);
+double repeatedsweep(double);
+double smallparfor();
+double serialsettle(double);
+double parallelsettle(double);
 }
 
-extern "C" double burn(double x) {
+namespace {
+
+constexpr double kLimit = 5000.0;
+
+double burnRounds(double x, int rounds) {
   double value = x + 1.0;
-  for (int i = 0; i < 400; ++i) {
+  for (int i = 0; i < rounds; ++i) {
     value = std::sin(value) + std::cos(value) + std::sqrt(value + 2.0);
   }
   return value;
 }
 
+} // namespace
+
+extern "C" double burn(double x) { return burnRounds(x, 400); }
+
+// Irregular variant of burn: the last 2% of the iteration space costs 100x
+// the rest, which is the worst case for equal-sized up-front chunks.
+extern "C" double skewburn(double x) {
+  bool heavy = x >= kLimit * 0.98;
+  return burnRounds(x, heavy ? 4000 : 40);
+}
+
+namespace {
+
+// Memory-bound workload for repeated calls: iteration i updates its own 32 KB
+// slice of an 8 MB array. A worker that gets the same slices on every call
+// finds them in its own cache (and on its own memory node) instead of pulling
+// them from whichever core touched them last.
+constexpr std::size_t kSlices = 256;
+constexpr std::size_t kSliceDoubles = 4096;
+constexpr int kSweepCalls = 200;
+
+std::vector<double> sweepData(kSlices * kSliceDoubles, 1.0);
+
+} // namespace
+
+extern "C" double sweepslice(double x) {
+  double *slice =
+      sweepData.data() + static_cast<std::size_t>(x) * kSliceDoubles;
+  double sum = 0.0;
+  for (std::size_t i = 0; i < kSliceDoubles; ++i) {
+    slice[i] = slice[i] * 0.5 + 1.0;
+    sum += slice[i];
+  }
+  return sum;
+}
+
+extern "C" double tinywork(double x) { return x * 0.5; }
+
 namespace {
 
 using Clock = std::chrono::steady_clock;
 
-template <typename Func> double timeMillis(Func &&func, int trials) {
-  double totalMillis = 0.0;
+struct Timing {
+  double meanMillis = 0.0;
+  double maxMillis = 0.0;
+};
+
+template <typename Func> Timing timeMillis(Func &&func, int trials) {
+  Timing timing;
   for (int i = 0; i < trials; ++i) {
     auto start = Clock::now();
     func();
     auto end = Clock::now();
-    totalMillis +=
+    double millis =
         std::chrono::duration<double, std::milli>(end - start).count();
+    timing.meanMillis += millis;
+    timing.maxMillis = std::max(timing.maxMillis, millis);
   }
-  return totalMillis / static_cast<double>(trials);
+  timing.meanMillis /= static_cast<double>(trials);
+  return timing;
 }
 
 } // namespace
 
 int main() {
-  constexpr double kLimit = 5000.0;
   constexpr int kTrials = 3;
+  constexpr int kSkewTrials = 10;
 
-  double serialMs = timeMillis([] { serialburn(kLimit); }, kTrials);
-  double parallelMs = timeMillis([] { parallelburn(kLimit); }, kTrials);
+  const char *schedule = std::getenv("COMPILER_PARFOR_SCHEDULE");
+  const char *placement = std::getenv("COMPILER_PLACEMENT");
+  const char *tune = std::getenv("COMPILER_PARFOR_TUNE");
+
+  double serialMs = timeMillis([] { serialburn(kLimit); }, kTrials).meanMillis;
+  double parallelMs =
+      timeMillis([] { parallelburn(kLimit); }, kTrials).meanMillis;
   double speedup = parallelMs > 0.0 ? serialMs / parallelMs : 0.0;
 
-  std::printf("parfor benchmark limit=%.0f trials=%d\n", kLimit, kTrials);
+  std::printf("parfor benchmark limit=%.0f trials=%d schedule=%s "
+              "placement=%s tune=%s\n",
+              kLimit, kTrials, schedule ? schedule : "default",
+              placement ? placement : "none", tune ? tune : "off");
   std::printf("serialburn    %.3f ms\n", serialMs);
   std::printf("parallelburn  %.3f ms\n", parallelMs);
   std::printf("speedup       %.2fx\n", speedup);
+
+  Timing skewSerial =
+      timeMillis([] { skewedserialburn(kLimit); }, kSkewTrials);
+  Timing skewParallel =
+      timeMillis([] { skewedparallelburn(kLimit); }, kSkewTrials);
+  double skewSpeedup = skewParallel.meanMillis > 0.0
+                           ? skewSerial.meanMillis / skewParallel.meanMillis
+                           : 0.0;
+
+  std::printf("skewed workload trials=%d\n", kSkewTrials);
+  std::printf("skewedserialburn    mean %.3f ms  max %.3f ms\n",
+              skewSerial.meanMillis, skewSerial.maxMillis);
+  std::printf("skewedparallelburn  mean %.3f ms  max %.3f ms\n",
+              skewParallel.meanMillis, skewParallel.maxMillis);
+  std::printf("skewed speedup      %.2fx\n", skewSpeedup);
+
+  // The first call faults the array in; only the repeated calls are timed.
+  repeatedsweep(static_cast<double>(kSlices));
+  Timing sweep = timeMillis(
+      [] { repeatedsweep(static_cast<double>(kSlices)); }, kSweepCalls);
+  std::printf("repeated calls over the same range calls=%d\n", kSweepCalls);
+  std::printf("repeatedsweep       mean %.3f ms  max %.3f ms\n",
+              sweep.meanMillis, sweep.maxMillis);
+
+  // Small loops are timed in batches, since one call takes microseconds.
+  constexpr int kSmallCalls = 100000;
+  const char *inlineWork = std::getenv("COMPILER_PARFOR_INLINE_WORK");
+  Timing small = timeMillis(
+      [] {
+        for (int i = 0; i < kSmallCalls; ++i) {
+          smallparfor();
+        }
+      },
+      kTrials);
+  std::printf("small loops calls=%d inline_work=%s\n", kSmallCalls,
+              inlineWork ? inlineWork : "default");
+  std::printf("smallparfor         %.3f us per call\n",
+              small.meanMillis * 1000.0 / kSmallCalls);
+
+  // Unlike burn, settle is compiled code, so these follow the -O level.
+  double settleSerialMs =
+      timeMillis([] { serialsettle(kLimit); }, kTrials).meanMillis;
+  double settleParallelMs =
+      timeMillis([] { parallelsettle(kLimit); }, kTrials).meanMillis;
+  std::printf("compiled arithmetic limit=%.0f\n", kLimit);
+  std::printf("serialsettle        %.3f ms\n", settleSerialMs);
+  std::printf("parallelsettle      %.3f ms\n", settleParallelMs);
   return 0;
 }
@@ -1,6 +1,9 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <mutex>
 #include <vector>
 
@@ -64,15 +67,105 @@ extern "C" double recordvalue(double value) {
   return value;
 }
 
+extern "C" double harmonicterm(double i) { return 1.0 / (i + 1.0); }
+
 extern "C" {
 double parforcount();
 double parfordefaultstep();
 double parforstep();
 double parforcapture(double);
 double parfornested();
+double parfordeepnested();
 double parforempty();
+double parforsum(double);
+double parforproduct();
+double parformin();
+double parformax();
+double parforsumcapture(double);
+double parforsumnested();
+double parforemptymin();
+double parforemptyproduct();
+double parforuserop();
+double parforfirst(double);
+double parforharmonic(double);
+}
+
+namespace {
+
+void checkReductions() {
+  expectClose("parforsum", parforsum(1000.0), 499500.0);
+  expectClose("parforsum single", parforsum(1.0), 0.0);
+  expectClose("parforproduct", parforproduct(), 3628800.0);
+  expectClose("parformin", parformin(), 5.0);
+  expectClose("parformax", parformax(), 2500.0);
+  expectClose("parforsumcapture", parforsumcapture(3.0), 75.0);
+  expectClose("parforsumnested", parforsumnested(), 2025.0);
+  expectClose("parforemptyproduct", parforemptyproduct(), 1.0);
+  expectClose("parforuserop", parforuserop(), 1023.0);
+
+  double emptyMin = parforemptymin();
+  if (emptyMin != std::numeric_limits<double>::infinity()) {
+    std::fprintf(stderr, "FAIL parforemptymin: expected inf, got %.12f\n",
+                 emptyMin);
+    ++failures;
+  } else {
+    std::printf("PASS parforemptymin = inf\n");
+  }
+
+  // Rounding may differ from a sequential sum, but only slightly.
+  constexpr double kTerms = 100000.0;
+  double sequential = 0.0;
+  for (double i = 0.0; i < kTerms; i += 1.0) {
+    sequential += harmonicterm(i);
+  }
+  double harmonic = parforharmonic(kTerms);
+  if (std::fabs(harmonic - sequential) > 1e-9) {
+    std::fprintf(stderr, "FAIL parforharmonic: expected %.12f, got %.12f\n",
+                 sequential, harmonic);
+    ++failures;
+  } else {
+    std::printf("PASS parforharmonic = %.12f\n", harmonic);
+  }
+
+  const char *order = std::getenv("COMPILER_PARFOR_REDUCE");
+  if (!order || std::strcmp(order, "deterministic") != 0) {
+    return;
+  }
+
+  // The deterministic order combines in iteration order and reproduces the
+  // same bits on every run.
+  expectClose("parforfirst", parforfirst(10000.0), 1.0);
+  for (int run = 0; run < 20; ++run) {
+    double again = parforharmonic(kTerms);
+    if (std::memcmp(&again, &harmonic, sizeof(double)) != 0) {
+      std::fprintf(stderr,
+                   "FAIL parforharmonic deterministic: %.17g != %.17g\n",
+                   again, harmonic);
+      ++failures;
+      return;
+    }
+  }
+  std::printf("PASS parforharmonic deterministic\n");
+}
+
+// Calls one loop often enough for the runtime to try several grain sizes and
+// participant counts on it, none of which may change the result.
+void checkTuning() {
+  constexpr int kCalls = 300;
+  for (int call = 0; call < kCalls; ++call) {
+    double sum = parforsum(10000.0);
+    if (sum != 49995000.0) {
+      std::fprintf(stderr, "FAIL parforsum tuning: call %d returned %.12f\n",
+                   call, sum);
+      ++failures;
+      return;
+    }
+  }
+  std::printf("PASS parforsum tuning (%d calls)\n", kCalls);
 }
 
+} // namespace
+
 int main() {
   resetRecordedValues();
   expectClose("parforcount return", parforcount(), 0.0);
@@ -94,10 +187,25 @@ int main() {
   expectClose("parfornested return", parfornested(), 0.0);
   expectValues("parfornested", {0, 1, 10, 11, 20, 21});
 
+  resetRecordedValues();
+  expectClose("parfordeepnested return", parfordeepnested(), 0.0);
+  std::vector<double> deepNested;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      for (int k = 0; k < 2; ++k) {
+        deepNested.push_back(i * 100 + j * 10 + k);
+      }
+    }
+  }
+  expectValues("parfordeepnested", deepNested);
+
   resetRecordedValues();
   expectClose("parforempty return", parforempty(), 0.0);
   expectValues("parforempty", {});
 
+  checkReductions();
+  checkTuning();
+
   if (failures != 0) {
     std::fprintf(stderr, "%d parfor check(s) failed\n", failures);
     return 1;
@@ -0,0 +1,141 @@
+#include "../runtime_stats.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+extern "C" {
+int __compiler_set_num_workers(std::size_t);
+std::size_t __compiler_num_workers();
+double poolsum(double);
+double poolfib(double);
+}
+
+namespace {
+
+constexpr double kTolerance = 1e-9;
+int failures = 0;
+
+void expectClose(const char *name, double actual, double expected) {
+  if (std::fabs(actual - expected) > kTolerance) {
+    std::fprintf(stderr, "FAIL %s: expected %.12f, got %.12f\n", name, expected,
+                 actual);
+    ++failures;
+    return;
+  }
+  std::printf("PASS %s = %.12f\n", name, actual);
+}
+
+void expectWorkers(const char *name, std::size_t expected) {
+  std::size_t actual = __compiler_num_workers();
+  if (actual != expected) {
+    std::fprintf(stderr, "FAIL %s: expected %zu workers, got %zu\n", name,
+                 expected, actual);
+    ++failures;
+    return;
+  }
+  std::printf("PASS %s = %zu workers\n", name, actual);
+}
+
+void runWork(const char *name) {
+  std::printf("%s:\n", name);
+  expectClose("  poolsum", poolsum(10000.0), 49995000.0);
+  expectClose("  poolfib", poolfib(16.0), 987.0);
+}
+
+RuntimeWorkerStats totalStats() {
+  std::vector<RuntimeWorkerStats> rows(__compiler_runtime_stats(nullptr, 0));
+  std::size_t count = __compiler_runtime_stats(rows.data(), rows.size());
+  if (count < __compiler_num_workers() + 1) {
+    std::fprintf(stderr, "FAIL stats: %zu rows for %zu workers\n", count,
+                 __compiler_num_workers());
+    ++failures;
+  }
+  RuntimeWorkerStats total{};
+  for (const RuntimeWorkerStats &row : rows) {
+    total.tasks += row.tasks;
+    total.chunks += row.chunks;
+    for (std::uint64_t samples : row.queueWait) {
+      total.queueWait[0] += samples;
+    }
+  }
+  return total;
+}
+
+// poolfib(16) issues 1596 async tasks and poolsum runs at least one range;
+// about one task in sixteen has its queue wait sampled.
+void checkStats() {
+  RuntimeWorkerStats before = totalStats();
+  poolfib(16.0);
+  poolsum(10000.0);
+  RuntimeWorkerStats after = totalStats();
+  expectClose("stats count every task",
+              after.tasks - before.tasks >= 1596 ? 1.0 : 0.0, 1.0);
+  expectClose("stats count parfor ranges",
+              after.chunks > before.chunks ? 1.0 : 0.0, 1.0);
+  expectClose("stats sample queue waits",
+              after.queueWait[0] > before.queueWait[0] ? 1.0 : 0.0, 1.0);
+}
+
+} // namespace
+
+// Usage: pool_runtime_tests [expected-initial-workers]
+// Run under `taskset -c 0` with COMPILER_NUM_WORKERS unset and an expected
+// count of 1 to check that the pool follows the affinity mask.
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    expectWorkers("initial pool", std::strtoul(argv[1], nullptr, 10));
+  }
+  runWork("initial pool");
+
+  const std::size_t counts[] = {4, 2, 1, 3};
+  for (std::size_t count : counts) {
+    if (__compiler_set_num_workers(count) != 0) {
+      std::fprintf(stderr, "FAIL resize to %zu was rejected\n", count);
+      ++failures;
+    }
+    expectWorkers("resized pool", count);
+    runWork("resized pool");
+  }
+
+  if (__compiler_set_num_workers(0) != -1) {
+    std::fprintf(stderr, "FAIL a zero worker count was accepted\n");
+    ++failures;
+  } else {
+    std::printf("PASS zero worker count rejected\n");
+  }
+
+  // Resize continuously while another thread keeps the pool busy.
+  std::atomic<bool> stop{false};
+  std::thread resizer([&stop] {
+    std::size_t count = 1;
+    while (!stop.load()) {
+      __compiler_set_num_workers(count);
+      count = count % 4 + 1;
+      std::this_thread::yield();
+    }
+  });
+  int mismatches = 0;
+  for (int round = 0; round < 50; ++round) {
+    if (poolfib(12.0) != 144.0 || poolsum(1000.0) != 499500.0) {
+      ++mismatches;
+    }
+  }
+  stop.store(true);
+  resizer.join();
+  expectClose("work during resizes", mismatches, 0.0);
+
+  checkStats();
+
+  if (failures != 0) {
+    std::fprintf(stderr, "%d pool check(s) failed\n", failures);
+    return 1;
+  }
+
+  std::printf("All pool checks passed\n");
+  return 0;
+}